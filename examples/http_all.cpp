@@ -67,6 +67,11 @@ int main(int argc,char **argv) {
 					}
 				}
 
+				// counters in the Prometheus text format
+				if (auto r=net11::http::match_metrics(c)) {
+					return r;
+				}
+
 				// change the / url to the indexpage
 				if (c.url()=="/") {
 					c.url()="/index.html";
@@ -86,10 +91,8 @@ int main(int argc,char **argv) {
 		return -1;
 	}
 
-	while(l.poll()) {
-		sched.poll();
-		net11::yield();
-	}
+	// serve requests and run the scheduled events, sleeping in between
+	l.run(sched);
 
 	return 0;
 }
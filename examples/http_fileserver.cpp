@@ -19,8 +19,6 @@ int main(int argc,char **argv) {
 		printf("Could not listen on %s\n",argv[1]);
 		return -2;
 	}
-	while(tcp.poll()) {
-		net11::yield();
-	}
+	tcp.run();
 	return 0;
 }
@@ -21,10 +21,8 @@ int main(int argc,char **argv) {
 	}
 
 	// request the TCP system to do som work
-	while(tcp.poll()) {
-		// then sleep for a short while to make sure we don't eat up all CPU time.
-		net11::yield();
-	}
+	// (run blocks waiting for network events so no CPU time is used while idle)
+	tcp.run();
 
 	return 0;
 }
@@ -0,0 +1,36 @@
+#include <iostream>
+#include <net11/http.hpp>
+
+int main(int argc,char **argv) {
+	net11::tcp tcp;
+
+	// routes are matched by pattern, :name captures one path segment and * the rest
+	net11::http::router r;
+	r.get("/users/:id",[](net11::http::connection &c)->net11::http::action {
+		return net11::http::make_text_response(200,"user "+c.param("id").str());
+	});
+	r.put("/users/:id",[](net11::http::connection &c)->net11::http::action {
+		return net11::http::make_text_response(200,"updated user "+c.param("id").str());
+	});
+	r.get("/users/:id/posts/*",[](net11::http::connection &c)->net11::http::action {
+		return net11::http::make_text_response(200,"post "+c.param("*").str()+" of user "+c.param("id").str());
+	});
+	r.get("/metrics",[](net11::http::connection &c)->net11::http::action {
+		return net11::http::match_metrics(c);
+	});
+
+	// everything else is served from files
+	r.otherwise([](net11::http::connection &c)->net11::http::action {
+		return net11::http::match_file(c,"/","public_html/");
+	});
+
+	// the router is the route function of the server
+	if (net11::http::start_server(tcp,8080,r)) {
+		printf("Error listening\n");
+		return -1;
+	}
+
+	tcp.run();
+
+	return 0;
+}
@@ -0,0 +1,38 @@
+#include <iostream>
+#include <net11/http.hpp>
+
+// the paths of a route table are constexpr char arrays
+constexpr char hello_path[]="/hello";
+constexpr char status_path[]="/status";
+
+net11::http::action hello(net11::http::connection &) {
+	return net11::http::make_text_response(200,"Hello world!");
+}
+
+net11::http::action status(net11::http::connection &) {
+	return net11::http::make_text_response(200,"ok");
+}
+
+net11::http::action files(net11::http::connection &c) {
+	return net11::http::match_file(c,"/","public_html/");
+}
+
+// the table is compiled into the server, the first matching route is used
+using routes=net11::http::route_table<
+	net11::http::static_route<hello_path,hello>,
+	net11::http::static_route<status_path,status,net11::http::get_method>,
+	net11::http::static_otherwise<files>
+>;
+
+int main(int argc,char **argv) {
+	net11::tcp tcp;
+
+	if (net11::http::start_server<routes>(tcp,8080)) {
+		printf("Error listening\n");
+		return -1;
+	}
+
+	tcp.run();
+
+	return 0;
+}
@@ -35,7 +35,7 @@ public:
 
 			// sending data is done by pushing a producer that contains the data we want.
 			// (A more advanced producer could be written that reads in data from a file for example)
-			conn->producers.push_back(net11::make_data_producer(tmp));
+			conn->send(net11::make_data_producer(tmp));
 
 			// reset our tmp buf for next time.
 			tmp.clear();
@@ -64,10 +64,8 @@ int main(int argc,char **argv) {
 	}
 
 	// request the TCP system to do some work
-	while(tcp.poll()) {
-		// then sleep for a short while to make sure we don't eat up all CPU time.
-		net11::yield();
-	}
+	// (run blocks waiting for network events so no CPU time is used while idle)
+	tcp.run();
 
 	return 0;
 }
@@ -1,5 +1,6 @@
 #include <string>
 #include <map>
+#include <deque>
 #include <algorithm>
 
 #include <iostream>
@@ -28,6 +29,11 @@ namespace net11 {
 
 		class consume_action;
 		using action=std::unique_ptr<actiondata>;
+		// Routes urls by patterns to handlers, usable as the route function
+		class router;
+		// Connections of servers with a route table fixed at compile time
+		template<class ROUTES>
+		class static_connection;
 		using response=std::unique_ptr<responsedata>;
 		using wsresponse=std::unique_ptr<websocket_response>;
 
@@ -36,6 +42,146 @@ namespace net11 {
 		class websocket_sink;
 		class websocket;
 
+		struct request_counters {
+			uint64_t requests;     // requests passed to the router
+			uint64_t responses[6]; // responses by status class, [4] counts 4xx
+			uint64_t not_found;    // requests that the router had no action for
+			uint64_t bad_requests; // requests that failed to parse
+			uint64_t frames_in;    // websocket frames received
+			uint64_t frames_out;   // websocket frames sent
+		};
+		// the counts of a thread running servers, summed by request_totals()
+		struct request_block {
+			net11::counter requests;
+			net11::counter responses[6];
+			net11::counter not_found;
+			net11::counter bad_requests;
+			net11::counter frames_in;
+			net11::counter frames_out;
+			static net11::counter_registry<request_block,request_counters>& registry() {
+				static net11::counter_registry<request_block,request_counters> r;
+				return r;
+			}
+			request_block() {
+				registry().add(this);
+			}
+			~request_block() {
+				registry().remove(this);
+			}
+			void sum(request_counters &out) const {
+				out.requests+=requests.get();
+				for (int i=0;i<6;i++)
+					out.responses[i]+=responses[i].get();
+				out.not_found+=not_found.get();
+				out.bad_requests+=bad_requests.get();
+				out.frames_in+=frames_in.get();
+				out.frames_out+=frames_out.get();
+			}
+		};
+		request_block& thread_requests() {
+			static thread_local request_block b;
+			return b;
+		}
+		// the counts of the calling thread
+		request_counters request_stats() {
+			request_counters out;
+			memset(&out,0,sizeof(out));
+			thread_requests().sum(out);
+			return out;
+		}
+		// the counts of all threads, safe to call from any thread
+		request_counters request_totals() {
+			return request_block::registry().total();
+		}
+
+		// finds the blank line ending a request head, returns the head length
+		// including it or 0. The search resumes from the bytes already scanned.
+		size_t find_head_end(const char *p,size_t len,size_t scanned) {
+			size_t from=scanned>3?scanned-3:0;
+			size_t end=scan::head_end(p+from,len-from);
+			return end?from+end:0;
+		}
+
+		// Header names that the server itself looks at are interned to ids as
+		// a request is parsed, finding one of them is then an array index.
+		enum header_id {
+			hdr_other=0,
+			hdr_host,
+			hdr_connection,
+			hdr_upgrade,
+			hdr_content_length,
+			hdr_transfer_encoding,
+			hdr_authorization,
+			hdr_sec_websocket_key,
+			hdr_sec_websocket_version,
+			hdr_sec_websocket_protocol,
+			hdr_sec_websocket_extensions,
+			hdr_count
+		};
+		// FNV-1a with the case bit of every byte set, so that names differing
+		// in case hash the same. Equal hashes are confirmed with ieq().
+		// The constexpr forms are single returns so that c++11 takes them as case labels.
+		constexpr uint32_t header_hash(const char *p,size_t n,uint32_t h=2166136261u) {
+			return n==0?h:header_hash(p+1,n-1,(h^(uint8_t)(p[0]|0x20))*16777619u);
+		}
+		constexpr uint32_t header_hash_str(const char *str,uint32_t h) {
+			return *str?header_hash_str(str+1,(h^(uint8_t)(str[0]|0x20))*16777619u):h;
+		}
+		constexpr uint32_t header_hash(const char *str) {
+			return header_hash_str(str,2166136261u);
+		}
+		// parsed names are hashed with a loop instead of the recursion
+		uint32_t header_hash(string_ref name) {
+			uint32_t h=2166136261u;
+			for (size_t i=0;i<name.size();i++)
+				h=(h^(uint8_t)(name.data()[i]|0x20))*16777619u;
+			return h;
+		}
+		// the lowercase name of an interned header
+		const char* header_name(header_id id) {
+			static const char *names[hdr_count]={
+				"",
+				"host",
+				"connection",
+				"upgrade",
+				"content-length",
+				"transfer-encoding",
+				"authorization",
+				"sec-websocket-key",
+				"sec-websocket-version",
+				"sec-websocket-protocol",
+				"sec-websocket-extensions"
+			};
+			return names[id];
+		}
+		// the id of a name with the given header_hash, hdr_other if it isn't interned
+		header_id intern_header(string_ref name,uint32_t hash) {
+			header_id id;
+			switch(hash) {
+			case header_hash("host") : id=hdr_host; break;
+			case header_hash("connection") : id=hdr_connection; break;
+			case header_hash("upgrade") : id=hdr_upgrade; break;
+			case header_hash("content-length") : id=hdr_content_length; break;
+			case header_hash("transfer-encoding") : id=hdr_transfer_encoding; break;
+			case header_hash("authorization") : id=hdr_authorization; break;
+			case header_hash("sec-websocket-key") : id=hdr_sec_websocket_key; break;
+			case header_hash("sec-websocket-version") : id=hdr_sec_websocket_version; break;
+			case header_hash("sec-websocket-protocol") : id=hdr_sec_websocket_protocol; break;
+			case header_hash("sec-websocket-extensions") : id=hdr_sec_websocket_extensions; break;
+			default :
+				return hdr_other;
+			}
+			return name.ieq(header_name(id))?id:hdr_other;
+		}
+
+		// a request header, see connection::header_refs()
+		struct header_field {
+			string_ref name;
+			string_ref value;
+			uint32_t hash;
+			header_id id;
+		};
+
 		// RFC 2616 sec2 Token
 		bool parse_token_byte(std::string *out,buffer &in) {
 			switch(in.peek()) {
@@ -112,10 +258,10 @@ namespace net11 {
 		class responsedata : public actiondata {
 			friend class connection;
 			friend class websocket_response;
-			friend response make_stream_response(int code,std::function<bool(buffer &data)> prod);
+			friend response make_stream_response(int code,producer prod);
 
 			std::map<std::string,std::string> head;
-			std::function<bool(buffer &)> prod;
+			producer prod;
 
 			responsedata(){}
 		protected:
@@ -141,6 +287,10 @@ namespace net11 {
 			friend class consume_action;
 			friend class websocket;
 			friend class websocket_response;
+			friend class router;
+			template<class ROUTES>
+			friend class static_connection;
+			friend class net11::pool<connection>;
 
 			// reference to the actual tcp connection that does input/output
 			tcp::connection *tconn;
@@ -148,33 +298,325 @@ namespace net11 {
 			// a weak this-ptr used to provide the shared ptr to things that needs a reference.
 			std::weak_ptr<connection> wthis;
 
-			// the reqlinesink parses request lines (finds method, url and http version data)
-			std::shared_ptr<sink> reqlinesink;
-			// contain the found data
+			// The head sink waits until a request head (the request line and the
+			// headers up to the blank line) is complete in the input buffer and
+			// parses it where it lies, a head that outgrows the buffer is moved
+			// to a string. The header timeout of the connection starts with its
+			// first byte.
+			class head_sink : public sink {
+				friend class connection;
+				static const size_t max_head=128*1024;
+				connection *conn;
+				size_t scanned;    // bytes already searched for the end of the head
+				std::string spill; // a head larger than the input buffer
+				head_sink(connection *in_conn):conn(in_conn),scanned(0) {}
+				void reset() {
+					scanned=0;
+					spill.clear();
+				}
+			public:
+				// bytes of a head that has started to arrive
+				size_t pending() {
+					return scanned;
+				}
+				virtual bool drain(buffer &buf) {
+					size_t len=buf.usage();
+					if (!len)
+						return true;
+					conn->tconn->start_header_timer();
+					const char *p=buf.to_consume();
+					size_t old=spill.size();
+					if (old) {
+						spill.append(p,len);
+						p=spill.data();
+						len=spill.size();
+					}
+					size_t end=find_head_end(p,len,scanned);
+					if (!end) {
+						scanned=len;
+						if (len>max_head)
+							return conn->bad_request();
+						// the head can't complete in a full buffer, continue it aside
+						if (old || !buf.total_avail()) {
+							if (!old)
+								spill.assign(p,len);
+							buf.consumed(buf.usage());
+						}
+						return true;
+					}
+					// the consumed bytes stay in place until the buffer is filled
+					// again, the rest is left for the body or the next request.
+					buf.consumed((int)(end-old));
+					scanned=0;
+					bool rv=conn->parse_head(p,end) && conn->start_request();
+					spill.clear();
+					return rv;
+				}
+			};
+			std::shared_ptr<head_sink> headsink;
+
+			// the request as references into the input, see method_ref()
+			string_ref req_method;
+			string_ref req_url;
+			string_ref req_version;
+			std::vector<header_field> req_headers;
+			// the index+1 of the last header with each id, 0 when absent
+			uint32_t known_headers[hdr_count];
+			// where the head was parsed, it's copied to head_store when a body follows
+			const char *head_base=nullptr;
+			size_t head_len=0;
+			std::string head_store;
+			// the trailers of chunked bodies are added as headers from here
+			std::deque<std::string> trailer_store;
+			// the std::string forms are copied from the references on first use
 			std::string reqline[3];
+			bool line_copied=false;
+			// a copy slot per header, kept between requests (a deque so trailers don't move them)
+			std::deque<std::string> header_copies;
+			std::vector<bool> header_copied;
+			void copy_line() {
+				if (line_copied)
+					return;
+				line_copied=true;
+				reqline[0]=req_method.str();
+				reqline[1]=req_url.str();
+				reqline[2]=req_version.str();
+			}
+			void add_header(string_ref name,string_ref value) {
+				header_field f;
+				f.name=name;
+				f.value=value;
+				f.hash=header_hash(name);
+				f.id=intern_header(name,f.hash);
+				req_headers.push_back(f);
+				if (f.id!=hdr_other)
+					known_headers[f.id]=(uint32_t)req_headers.size();
+			}
+			void clear_headers() {
+				req_headers.clear();
+				memset(known_headers,0,sizeof(known_headers));
+			}
+			// the index of the last header with the name, -1 if none
+			int find_header(string_ref name) {
+				uint32_t h=header_hash(name);
+				header_id id=intern_header(name,h);
+				if (id!=hdr_other)
+					return (int)known_headers[id]-1;
+				for (size_t i=req_headers.size();i--;) {
+					if (req_headers[i].hash==h && req_headers[i].name.ieq(name))
+						return (int)i;
+				}
+				return -1;
+			}
+			std::string* copy_header(int idx) {
+				if (idx<0)
+					return nullptr;
+				if (header_copied.size()<req_headers.size())
+					header_copied.resize(req_headers.size(),false);
+				if (header_copies.size()<req_headers.size())
+					header_copies.resize(req_headers.size());
+				std::string &out=header_copies[idx];
+				if (!header_copied[idx]) {
+					header_copied[idx]=true;
+					out.assign(req_headers[idx].value.data(),req_headers[idx].value.size());
+				}
+				return &out;
+			}
+			// moves the references of a head that a body follows out of the input
+			void keep_head() {
+				head_store.assign(head_base,head_len);
+				const char *base=head_store.data();
+				auto rebase=[&](string_ref &r) {
+					r=string_ref(base+(r.data()-head_base),r.size());
+				};
+				rebase(req_method);
+				rebase(req_url);
+				if (!req_version.empty())
+					rebase(req_version);
+				for (auto &h:req_headers) {
+					rebase(h.name);
+					rebase(h.value);
+				}
+				head_base=base;
+			}
+			std::string lower_value(const string_ref *v) {
+				std::string out;
+				if (v) {
+					out.resize(v->size());
+					scan::lower(&out[0],v->data(),v->size());
+				}
+				return out;
+			}
+			template<class T>
+			void csv_values(const string_ref *v,const T& fn,bool param_tolower) {
+				if (!v)
+					return;
+				std::string h;
+				auto & is=*v;
+				for(size_t i=0;i<=is.size();) {
+					bool end=i==is.size();
+					if (!end && !h.size() && isspace(is[i])) {
+						i++;
+						continue;
+					}
+					if (end || is[i]==',') {
+						if (h.size())
+							fn(h);
+						h.clear();
+						i++;
+						continue;
+					}
+					if (param_tolower) {
+						h+=tolower(is[i++]);
+					} else {
+						h+=is[i++];
+					}
+				}
+			}
+			// path parameters captured by a router, the names belong to the route
+			static const int max_params=16;
+			string_ref param_values[max_params];
+			const std::vector<std::string> *param_names=nullptr;
+			int param_count=0;
+			// HTTP/1.1 connections are kept alive for more requests
+			bool keep_alive=false;
+			// a request has been read on this connection
+			bool served=false;
+
+			bool bad_request() {
+				thread_requests().bad_requests.add();
+				return false;
+			}
+			// splits a complete head into references, false on syntax errors
+			bool parse_head(const char *p,size_t len) {
+				const char *end=p+len;
+				head_base=p;
+				head_len=len;
+				clear_headers();
+				trailer_store.clear();
+				bool first=true;
+				while (p<end) {
+					const char *nl=(const char*)memchr(p,'\n',end-p);
+					// lines end with CRLF, a lone LF is an error
+					if (!nl || nl==p || nl[-1]!='\r')
+						return bad_request();
+					string_ref line(p,nl-1-p);
+					p=nl+1;
+					if (first) {
+						// method SP url SP version
+						first=false;
+						size_t sp=line.find(' ');
+						if (sp==0 || sp==string_ref::npos)
+							return bad_request();
+						req_method=line.substr(0,sp);
+						while (sp<line.size() && line[sp]==' ')
+							sp++;
+						size_t usp=line.find(' ',sp);
+						req_url=line.substr(sp,usp==string_ref::npos?usp:usp-sp);
+						if (req_url.empty())
+							return bad_request();
+						if (usp!=string_ref::npos) {
+							while (usp<line.size() && line[usp]==' ')
+								usp++;
+							req_version=line.substr(usp);
+						} else {
+							req_version=string_ref();
+						}
+						continue;
+					}
+					if (line.empty())
+						break;
+					// folded lines (RFC 7230 3.2.4) and names with whitespace are rejected
+					size_t colon=scan::find2(line.data(),line.size(),':',' ');
+					if (colon==0 || colon==line.size() || line[colon]!=':' || memchr(line.data(),'\t',colon))
+						return bad_request();
+					size_t vs=colon+1,ve=line.size();
+					while (vs<ve && (line[vs]==' ' || line[vs]=='\t'))
+						vs++;
+					while (ve>vs && (line[ve-1]==' ' || line[ve-1]=='\t'))
+						ve--;
+					add_header(line.substr(0,colon),line.substr(vs,ve-vs));
+				}
+				return true;
+			}
+			// picks the body sink and routes a parsed request
+			bool start_request() {
+				served=true;
+				produced=false;
+				consume_fun=nullptr;
+				line_copied=false;
+				header_copied.clear();
+				param_names=nullptr;
+				param_count=0;
+				keep_alive=req_version=="HTTP/1.1";
+				tconn->stop_header_timer();
+#ifdef NET11_VERBOSE
+				std::cout<<"req:"<<req_method.str()<<" url:"<<req_url.str()<<" ver:"<<req_version.str()<<"\n";
+				for (auto &h:req_headers)
+					std::cout<<"HeadKey=["<<h.name.str()<<"] HeadValue=["<<h.value.str()<<"]\n";
+#endif
+				// determine content based on RFC 2616 pt 4.4, the sink is set
+				// before routing in case the router and/or action wants to hijack it
+				const string_ref *te=header_ref(hdr_transfer_encoding);
+				const string_ref *cl=header_ref(hdr_content_length);
+				if (te && !te->ieq("identity")) {
+					// Chunked encoding if transfer-encoding header exists and isn't set to identity
+					tconn->current_sink=m_chunkedcontentsink;
+				} else if (cl) {
+					// only allow content-length influence IFF no transfer-enc is present
+					size_t clen=0;
+					if (cl->empty())
+						return bad_request();
+					for (char ch:*cl) {
+						if (ch<'0' || ch>'9' || clen>((size_t)-1)/10-1)
+							return bad_request();
+						clen=clen*10+(ch-'0');
+					}
+					m_sizedcontentsink->clen=clen;
+					tconn->current_sink=m_sizedcontentsink;
+				} else {
+					// this server doesn't handle other kinds of content
+					tconn->current_sink=nextreqsink();
+				}
+				// TODO: urlencodings?
+				thread_requests().requests.add();
+				action act=route();
+				bool rv=produce(std::move(act));
+				// the input is reused while a body is read, its handlers see a copy of the head
+				if (consume_fun || tconn->current_sink==m_chunkedcontentsink || tconn->current_sink==m_sizedcontentsink) {
+					keep_head();
+					return rv;
+				}
+				req_method=req_url=req_version=string_ref();
+				clear_headers();
+				return rv;
+			}
 
 			// decides the next default request sink (could be overridden by HTTP-upgrades)
 			std::shared_ptr<sink> nextreqsink() {
+				// a draining server finishes after the current response
+				if (draining)
+					return nullptr;
 				// by default we work with keep-alive connections on HTTP/1.1
 				// so we proceed to read another request.
-				if (reqline[2].size() && reqline[2]=="HTTP/1.1") {
-					return reqlinesink;
+				if (keep_alive) {
+					return headsink;
 				} else {
 					// on older HTTP versions we don't do more requests.
 					return nullptr;
 				}
 			}
 
-			// the header sink is responsible for parsing the http headers received.
-			std::shared_ptr<sink> headsink;
-			// the headers are stored here
-			std::map<std::string,std::string> headers;
-
-			std::shared_ptr<sink> postchunkedsink;
-			std::shared_ptr<sink> m_chunkedcontentsink;
+			class chunkedcontentsink;
+			std::shared_ptr<header_parser_sink> postchunkedsink;
+			std::shared_ptr<chunkedcontentsink> m_chunkedcontentsink;
 
-			// The router function, this function
-			const std::function<action(connection &conn)> router;
+			// The router function, shared by all connections of a server
+			std::shared_ptr<const std::function<action(connection &conn)>> router;
+			// static_connection replaces it with a compiled route table
+			virtual action route() {
+				return (*router)(*this);
+			}
 
 			// remenant of older consumption code?
 			// std::function<response*(buffer& data,bool end)> dataconsumer;
@@ -185,6 +627,17 @@ namespace net11 {
 
 			// only produce once per request
 			bool produced;
+			// set when the server drains, no further requests are read
+			bool draining=false;
+
+			// a keep-alive connection waiting for its next request is finished
+			// at once, others after the current response (a fresh connection
+			// serves the request that its client is about to send).
+			void drain() {
+				draining=true;
+				if (served && tconn->current_sink==headsink && !headsink->pending())
+					tconn->finish();
+			}
 			// actual function to invoke the requested production
 			bool produce(action&& act);
 
@@ -236,6 +689,15 @@ namespace net11 {
 				}
 				connection *conn;
 				chunkedcontentsink(connection *in_conn) : conn(in_conn),state(0),sstate(0),clen(0) {}
+				static bool syntax_error() {
+					thread_requests().bad_requests.add();
+					return false;
+				}
+				void reset() {
+					state=0;
+					sstate=0;
+					clen=0;
+				}
 			public:
 				virtual bool drain(buffer &buf) {
 					bool rv=true;
@@ -261,11 +723,11 @@ namespace net11 {
 							} else if (cv==13) {
 								state=2; // expect LF
 								continue;
-							} else return false; // syntax error here
+							} else return syntax_error();
 						case 2 : // chunk-LF
 							buf.consume(); // always consume
 							if (cv!=10)
-								return false; // syntax error
+								return syntax_error();
 							if (clen==0) {
 								state=0; sstate=0; clen=0;
 								conn->tconn->current_sink=conn->postchunkedsink;
@@ -277,13 +739,13 @@ namespace net11 {
 						case 3 : // content-CR
 							buf.consume();
 							if (cv!=13)
-								return false; // syntax error
+								return syntax_error();
 							state=4;
 							continue;
 						case 4 : // content-LF
 							buf.consume();
 							if (cv!=10)
-								return false; // syntax error
+								return syntax_error();
 							state=0; // go back to reading a chunk-size
 							continue;
 						case 5 : // ext-name
@@ -299,7 +761,7 @@ namespace net11 {
 								// or a CRLF to go to the content
 								state=2;
 								continue;
-							} else return false; // syntax error otherwise
+							} else return syntax_error();
 						case 6 : // start of ext value, could be...
 							if (cv=='\"') {
 								state=8; // a quoted string
@@ -347,81 +809,23 @@ namespace net11 {
 
 			connection(
 				tcp::connection* tcp_conn,
-				const std::function<action(connection &conn)>& in_router
+				const std::shared_ptr<const std::function<action(connection &conn)>>& in_router
 			):tconn(tcp_conn),router(in_router) {
-				reqlinesink=std::shared_ptr<sink>(new net11::line_parser_sink("\r\n",4096,[this](std::string &l){
-					bool in_white=false;
-					int outidx=0;
-					reqline[0].resize(0);
-					reqline[1].resize(0);
-					reqline[2].resize(0);
-					headers.clear();
-					produced=false;
-					for (int i=0;i<l.size();i++) {
-						char c=l[i];
-						if (isspace(c)) {
-							in_white=true;
-						} else {
-							if (in_white && outidx<2) {
-								outidx++;
-							}
-							reqline[outidx].push_back(c);
-							in_white=false;
-						}
-					}
-					if (outidx>0 && reqline[0].size() && reqline[1].size()) {
-						this->tconn->current_sink=headsink;
-						return true;
-					} else {
-						// TODO: error handling?!
-						return false;
-					}
-				}));
-				headsink=std::shared_ptr<sink>(new header_parser_sink(128*1024,tolower,
-					[this](std::string &k,std::string &v){
-#ifdef NET11_VERBOSE
-						std::cout<<"HeadKey=["<<k<<"] HeadValue=["<<v<<"]\n";
-#endif
-						headers[k]=v;
-						return true;
-					},
-					[this](const char *err) {
-#ifdef NET11_VERBOSE
-						std::cout<<"req:"<<reqline[0]<<" url:"<<reqline[1]<<" ver:"<<reqline[2]<<"\n";
-#endif
-						consume_fun=nullptr;
-						// reset our sink early in case the encoding, router and/or action wants to hijack it
-						// determine content based on RFC 2616 pt 4.4
-						auto tehead=this->header("transfer-encoding");
-						if ( tehead && *tehead!="identity" ) {
-							// Chunked encoding if transfer-encoding header exists and isn't set to identity
-							//std::cerr<<"CHUNKED!\n";
-							this->tconn->current_sink=m_chunkedcontentsink;
-						} else if (auto clhead=this->header("content-length")) {
-							//std::cerr<<"Content LEN\n";
-							// only allow content-length influence IFF no transfer-enc is present
-							net11::trim(*clhead);
-							size_t clen=std::stoi(*clhead);
-							m_sizedcontentsink->clen=clen>=0?clen:0;
-							this->tconn->current_sink=m_sizedcontentsink;
-						} else {
-							// this server doesn't handle other kinds of content
-							this->tconn->current_sink=nextreqsink();
-						}
-						// TODO: urlencodings?
-						action act=router(*this);
-						bool rv=produce(std::move(act));
-						return rv;
-					}
-				));
-				m_chunkedcontentsink=std::shared_ptr<sink>(new chunkedcontentsink(this));
+				headsink=std::shared_ptr<head_sink>(new head_sink(this));
+				m_chunkedcontentsink=std::shared_ptr<chunkedcontentsink>(new chunkedcontentsink(this));
 				m_sizedcontentsink=std::shared_ptr<sizedcontentsink>(new sizedcontentsink(this));
-				postchunkedsink=std::shared_ptr<sink>(new header_parser_sink(128*1024,tolower,
+				postchunkedsink=std::shared_ptr<header_parser_sink>(new header_parser_sink(128*1024,header_parser_sink::lower_keys,
 					[this](std::string &k,std::string &v) {
-						headers[k]=v;
+						trailer_store.push_back(k);
+						trailer_store.push_back(v);
+						add_header(trailer_store[trailer_store.size()-2],trailer_store.back());
 						return true;
 					},
 					[this](const char *err){
+						if (err) {
+							thread_requests().bad_requests.add();
+							return false;
+						}
 						response r=0;
 						if (consume_fun) {
 							r=consume_fun(NULL);
@@ -431,7 +835,55 @@ namespace net11 {
 						return rv;
 					}
 				));
-				tconn->current_sink=reqlinesink;
+				memset(known_headers,0,sizeof(known_headers));
+				tconn->current_sink=headsink;
+			}
+			// the sinks are kept when a pooled connection is reused, only their state is reset
+			void reuse(
+				tcp::connection* tcp_conn,
+				const std::shared_ptr<const std::function<action(connection &conn)>>& in_router
+			) {
+				tconn=tcp_conn;
+				router=in_router;
+				headsink->reset();
+				postchunkedsink->reset();
+				m_chunkedcontentsink->reset();
+				m_sizedcontentsink->clen=0;
+				produced=false;
+				draining=false;
+				keep_alive=false;
+				served=false;
+				tconn->current_sink=headsink;
+			}
+			// drops request state and anything captured by the router or actions
+			void release() {
+				tconn=nullptr;
+				router.reset();
+				consume_fun=nullptr;
+				for (auto &r:reqline)
+					r.clear();
+				clear_headers();
+				header_copied.clear();
+				trailer_store.clear();
+			}
+			// makes a pooled connection the context of a tcp connection, give_back
+			// returns it to its pool once the tcp connection lets go of it.
+			template<class C,class F>
+			static void attach(tcp::connection *tconn,C *p,F give_back) {
+				std::shared_ptr<connection> conn(
+					p,
+					[give_back](connection *c) {
+						c->release();
+						give_back(static_cast<C*>(c));
+					}
+				);
+				conn->wthis=conn;
+				// the tcp connection clears on_drain before it drops ctx
+				connection *hconn=conn.get();
+				tconn->on_drain=[hconn]() {
+					hconn->drain();
+				};
+				tconn->ctx=conn;
 			}
 			virtual ~connection() {
 				//printf("Killed http connection\n");
@@ -442,30 +894,72 @@ namespace net11 {
 			}
 		
 		public:
+			// The request as references into the connection's input, they are
+			// valid until the router returns. Use str() to keep a value, the
+			// std::string accessors below copy the request on first use.
+			string_ref method_ref() {
+				return req_method;
+			}
+			string_ref url_ref() {
+				return req_url;
+			}
+			string_ref version_ref() {
+				return req_version;
+			}
+			// the value of the last header with the name (ignoring case) or null
+			const string_ref* header_ref(string_ref name) {
+				int idx=find_header(name);
+				return idx<0?nullptr:&req_headers[idx].value;
+			}
+			const string_ref* header_ref(header_id id) {
+				uint32_t idx=known_headers[id];
+				return idx?&req_headers[idx-1].value:nullptr;
+			}
+			// the headers in the order they were received
+			const std::vector<header_field>& header_refs() {
+				return req_headers;
+			}
+			// A path parameter (":name" or "*" in the pattern) of the router
+			// route that matched, empty if there's none. The values are parts
+			// of url_ref() and are valid as long as it is.
+			string_ref param(string_ref name) {
+				for (int i=0;i<param_count;i++) {
+					if (name==(*param_names)[i])
+						return param_values[i];
+				}
+				return string_ref();
+			}
+			string_ref param(int idx) {
+				return idx<param_count?param_values[idx]:string_ref();
+			}
+			int params() {
+				return param_count;
+			}
+
 			std::string& method() {
+				copy_line();
 				return reqline[0];
 			}
 			std::string& url() {
+				copy_line();
 				return reqline[1]; // TODO should it be pre-decoded?
 			}
-			std::string* header(const char *in_k) {
-				std::string k(in_k);
-				return header(k);
+			std::string* header(const char *k) {
+				return copy_header(find_header(k));
 			}
 			std::string* header(std::string &k) {
-				auto f=headers.find(k);
-				if (f!=headers.end())
-					return &f->second;
-				else
-					return 0;
+				return copy_header(find_header(k));
+			}
+			std::string* header(header_id id) {
+				return copy_header((int)known_headers[id]-1);
 			}
 			std::unique_ptr<std::pair<std::string,std::string>> get_basic_auth() {
 				//auto bad=std::make_pair(std::string(""),std::string(""));
-				auto authhead=header("authorization");
+				auto authhead=header_ref(hdr_authorization);
 				if (!authhead)
 					return nullptr;
 				//std::cerr<<"To split:"<<(*authhead)<<std::endl;
-				auto authsep=net11::split(*authhead,' ');
+				auto authsep=net11::split(authhead->str(),' ');
 				//std::cerr<<"Type:"<<authsep.first<<" Val:"<<authsep.second<<std::endl;
 				net11::trim(authsep.first);
 				// only support basic auth right now
@@ -480,47 +974,24 @@ namespace net11 {
 				);
 			}
 			std::string lowerheader(const char *k) {
-				std::string ok(k);
-				return lowerheader(ok);
+				return lower_value(header_ref(k));
 			}
 			std::string lowerheader(std::string &k) {
-				std::string out;
-				auto f=headers.find(k);
-				if (f!=headers.end()) {
-					for (int i=0;i<f->second.size();i++)
-						out.push_back(tolower(f->second[i]));
-				}
-				return out;
+				return lower_value(header_ref(k));
+			}
+			std::string lowerheader(header_id id) {
+				return lower_value(header_ref(id));
 			}
 			template<class T>
-			void csvheaders(const std::string &k,T& fn,bool param_tolower=false) {
-				auto f=headers.find(k);
-				if (f==headers.end())
-					return;
-				std::string h;
-				auto & is=f->second;
-				for(int i=0;i<=is.size();) {
-					bool end=i==is.size();
-					if (!end && !h.size() && isspace(is[i])) {
-						i++;
-						continue;
-					}
-					if (end || is[i]==',') {
-						if (h.size())
-							fn(h);
-						h.clear();
-						i++;
-						continue;
-					}
-					if (param_tolower) {
-						h+=tolower(is[i++]);
-					} else {
-						h+=is[i++];
-					}
-				}
+			void csvheaders(const std::string &k,const T& fn,bool param_tolower=false) {
+				csv_values(header_ref(k),fn,param_tolower);
+			}
+			template<class T>
+			void csvheaders(header_id id,const T& fn,bool param_tolower=false) {
+				csv_values(header_ref(id),fn,param_tolower);
 			}
 			bool has_header(std::string &k) {
-				return headers.count(k)!=0;
+				return find_header(k)>=0;
 			}
 			bool has_header(const char *p) {
 #ifdef NET11_VERBOSE
@@ -529,12 +1000,15 @@ namespace net11 {
 					<<"HasHeader:"
 					<<p
 					<<" -> "
-					<<(headers.count(std::string(p))!=0)
+					<<(find_header(p)>=0)
 					<<" "
-					<<((headers.count(std::string(p))!=0)?("[[["+lowerheader(p)+"]]]"): ""s)
+					<<((find_header(p)>=0)?("[[["+lowerheader(p)+"]]]"): ""s)
 					<<"\n";
 #endif
-				return headers.count(std::string(p))!=0;
+				return find_header(p)>=0;
+			}
+			bool has_header(header_id id) {
+				return known_headers[id]!=0;
 			}
 			template<typename HEAD,typename... REST>
 			bool has_headers(HEAD head,REST... rest) {
@@ -542,15 +1016,27 @@ namespace net11 {
 			}
 		};
 
+		// connection state is recycled per thread since the same server function
+		// can be run by several loops (see tcp_group).
+		net11::pool<connection>& connection_pool() {
+			static thread_local net11::pool<connection> p;
+			return p;
+		}
+		// counters for the http connection objects of the calling thread
+		net11::pool_stats connection_stats() {
+			return connection_pool().stats();
+		}
+		void connection_pool_limit(size_t limit) {
+			connection_pool().limit(limit);
+		}
+
 		std::function<void(net11::tcp::connection*)> make_server(const std::function<action(connection &conn)>& route) {
+			auto shared_route=std::make_shared<const std::function<action(connection &conn)>>(route);
 			// now create a connection spawn function
-			return [route](net11::tcp::connection* tconn) {
-				std::shared_ptr<connection> conn(
-					new connection(tconn,route),
-					[](auto p) { delete p; }
-				);
-				conn->wthis=conn;
-				tconn->ctx=conn;
+			return [shared_route](net11::tcp::connection* tconn) {
+				connection::attach(tconn,connection_pool().create(tconn,shared_route),[](connection *p) {
+					connection_pool().release(p);
+				});
 			};
 		};
 
@@ -558,6 +1044,18 @@ namespace net11 {
 			return l.listen(port,make_server(route));
 		}
 
+#ifndef _MSC_VER
+		// serve on a unix domain socket path (a leading @ for the abstract namespace)
+		bool start_server(net11::tcp& l,const std::string &path,const std::function<action(connection&conn)>& route) {
+			return l.listen(path,make_server(route));
+		}
+#endif
+
+		// start the same router on every loop of a group, the route function is shared between threads
+		bool start_server(net11::tcp_group& g,int port,const std::function<action(connection&conn)>& route) {
+			return g.listen(port,make_server(route));
+		}
+
 		class consume_action : public action {
 		protected:
 			std::function<response(buffer*buf)> fn;
@@ -571,7 +1069,7 @@ namespace net11 {
 			~consume_action(){}
 		};
 
-		response make_stream_response(int code,std::function<bool(buffer &data)> prod) {
+		response make_stream_response(int code,producer prod) {
 			//auto out=new response();
 			response out(new responsedata()); //,[](auto p){delete p;} );
 			out->code=code;
@@ -594,6 +1092,7 @@ namespace net11 {
 			friend websocket_sink;
 			std::weak_ptr<connection> conn;
 			int input_type=-1;
+			bool close_sent=false;
 			websocket(std::weak_ptr<connection> in_conn):conn(in_conn),input_type(-1) {}
 		public:
 			std::shared_ptr<void> ctx;    // auxillary shared ptr to hold ownership of things to be destroyed with the connection
@@ -603,7 +1102,9 @@ namespace net11 {
 			}
 			static const int text=1;
 			static const int binary=2;
-			bool send(int ty,const char *data,uint64_t sz) {
+			// returns send_full when the reader falls behind, wait for
+			// on_writable before sending more.
+			send_result send(int ty,const char *data,uint64_t sz) {
 				if (auto c=conn.lock()) {
 					int shift;
 					int firstsize;
@@ -617,31 +1118,59 @@ namespace net11 {
 						shift=64;
 						firstsize=127;
 					}
-					std::shared_ptr<buffer> b(new buffer(2+(shift/8)+sz));
-					b->produce(0x80|ty);
-					b->produce(firstsize);
+					// the frame is queued as a data producer and sent without further copies
+					auto b=std::make_shared<std::vector<char>>();
+					b->reserve(2+(shift/8)+sz);
+					b->push_back(0x80|ty);
+					b->push_back(firstsize);
 					while(shift) {
 						shift-=8;
-						b->produce( (sz>>shift)&0xff );
-					}
-					std::memcpy(b->to_produce(),data,sz);
-					b->produced(sz);
-					c->tconn->producers.push_back([b](buffer& out) {
-						out.produce(*b);
-						return 0!=b->usage();
-					});
-					return true;
+						b->push_back( (sz>>shift)&0xff );
+					}
+					b->insert(b->end(),data,data+sz);
+					thread_requests().frames_out.add();
+					return c->tconn->send(make_data_producer(b));
 				} else {
 					// Sending to killed connection!
-					return false;
+					return send_closed;
 				}
 			}
-			bool send(const std::string& data) {
+			send_result send(const std::string& data) {
 				return send(text,data.data(),data.size());
 			}
-			bool send(const std::vector<char>& data) {
+			send_result send(const std::vector<char>& data) {
 				return send(binary,data.data(),data.size());
 			}
+			// starts the closing handshake with a status code, the connection
+			// is closed when the peer answers.
+			send_result close(int code=1000) {
+				if (close_sent)
+					return send_closed;
+				close_sent=true;
+				char status[2]={(char)(code>>8),(char)(code&0xff)};
+				return send(8,status,2);
+			}
+			// bytes queued and not yet taken by the peer
+			size_t queued() {
+				if (auto c=conn.lock())
+					return c->tconn->queued();
+				return 0;
+			}
+			// called when the output queue has drained below the low water
+			// mark after a send returned send_full.
+			void on_writable(std::function<void(websocket&)> fn) {
+				if (auto c=conn.lock()) {
+					if (!fn) {
+						c->tconn->on_writable=nullptr;
+						return;
+					}
+					std::weak_ptr<websocket> self=shared_from_this();
+					c->tconn->on_writable=[self,fn]() {
+						if (auto ws=self.lock())
+							fn(*ws);
+					};
+				}
+			}
 		};
 
 		class websocket_sink : public sink {
@@ -665,6 +1194,7 @@ namespace net11 {
 			
 			bool endit() {
 				bool fin=info&0x80;
+				thread_requests().frames_in.add();
 				if ((info&0xf)<=2) {
 					int type=info&0xf;
 					if (websock->input_type==-1) {
@@ -682,7 +1212,11 @@ namespace net11 {
 				} else {
 					// processing for non-data packets.
 					if ((info&0xf)==8) {
-						websock->send(8,control_data,0);
+						// answer a close unless it answers ours
+						if (!websock->close_sent) {
+							websock->close_sent=true;
+							websock->send(8,control_data,0);
+						}
 						return false;
 					} else if ((info&0xf)==9) {
 						// got a ping, need to do pong
@@ -818,6 +1352,14 @@ namespace net11 {
 			bool produce(connection &conn) {
 				produce_headers(conn);
 				conn.tconn->current_sink=sink;
+				// a draining server says goodbye with 1001 (going away)
+				std::weak_ptr<websocket> ws=sink->websock;
+				conn.tconn->on_drain=[ws]() {
+					if (auto s=ws.lock())
+						s->close(1001);
+				};
+				if (conn.draining)
+					conn.tconn->on_drain();
 				return true;
 			}
 		public:
@@ -828,29 +1370,30 @@ namespace net11 {
 
 		wsresponse make_websocket(connection &c,std::shared_ptr<websocket_sink> wssink) {
 			bool has_heads=c.has_headers(
-				"connection",
-				"upgrade",
+				hdr_connection,
+				hdr_upgrade,
 				//"origin",
-				"sec-websocket-version",
-				"sec-websocket-key");
+				hdr_sec_websocket_version,
+				hdr_sec_websocket_key);
 			//printf("Has heads?:%d\n",has_heads);
 			if (!has_heads)
 				return 0;
 			bool has_upgrade=false;
-			c.csvheaders("connection",[&](auto& hval){ if (hval=="upgrade") has_upgrade=true; },true);
+			c.csvheaders(hdr_connection,[&](auto& hval){ if (hval=="upgrade") has_upgrade=true; },true);
 			if (!has_upgrade) {
 				return 0;
 			}
-			if (c.lowerheader("upgrade")!="websocket") {
+			if (!c.header_ref(hdr_upgrade)->ieq("websocket")) {
 				return 0;
 			}
-			if (*c.header("sec-websocket-version")!="13") {
+			if (*c.header_ref(hdr_sec_websocket_version)!="13") {
 				return 0;
 			}
 			// hash the key and guid to know the response hash
 			net11::sha1 s;
 			char hash[20];
-			s.addbytes(*c.header("sec-websocket-key"));
+			const string_ref *key=c.header_ref(hdr_sec_websocket_key);
+			s.addbytes(key->data(),(int)key->size());
 			s.addbytes("258EAFA5-E914-47DA-95CA-C5AB0DC85B11",36);
 			s.digest(hash);
 			// base64 encode the hash into a response token
@@ -951,6 +1494,7 @@ namespace net11 {
 				return 0;
 			}
 
+#ifdef _MSC_VER
 			FILE *f=fopen(tmp.c_str(),"rb");
 			if (!f)
 				return 0;
@@ -978,6 +1522,440 @@ namespace net11 {
 			});
 			out->set_header("content-length",std::to_string(stbuf.st_size));
 			return out;
+#else
+			// file producers are sent with sendfile when the connection allows it
+			int fd=open(tmp.c_str(),O_RDONLY|O_CLOEXEC);
+			if (fd==-1)
+				return 0;
+			// take the size from the opened file in case it changed after the checks
+			if (fstat(fd,&stbuf)) {
+				close(fd);
+				return 0;
+			}
+			auto out=make_stream_response(200,make_file_producer(fd,0,stbuf.st_size));
+			out->set_header("content-length",std::to_string(stbuf.st_size));
+			return out;
+#endif
+		}
+
+		// the counters of all loops and server threads in the Prometheus text format
+		std::string metrics_text() {
+			std::string out;
+			auto metric=[&out](const char *name,const char *type,const char *help) {
+				out=out+"# HELP "+name+" "+help+"\n# TYPE "+name+" "+type+"\n";
+			};
+			auto value=[&out](const char *name,uint64_t v,const char *labels=nullptr) {
+				out=out+name+(labels?labels:"")+" "+std::to_string(v)+"\n";
+			};
+			tcp::traffic_counters t=tcp::traffic_totals();
+			metric("net11_connections_accepted_total","counter","Connections accepted by listeners.");
+			value("net11_connections_accepted_total",t.accepted);
+			metric("net11_connections_connected_total","counter","Outgoing connections established.");
+			value("net11_connections_connected_total",t.connected);
+			metric("net11_connections_closed_total","counter","Connections closed.");
+			value("net11_connections_closed_total",t.closed);
+			metric("net11_connections_open","gauge","Connections currently open.");
+			value("net11_connections_open",t.accepted+t.connected-t.closed);
+			metric("net11_received_bytes_total","counter","Bytes read from connections.");
+			value("net11_received_bytes_total",t.bytes_in);
+			metric("net11_sent_bytes_total","counter","Bytes written to connections.");
+			value("net11_sent_bytes_total",t.bytes_out);
+			metric("net11_output_queued_bytes","gauge","Bytes queued for sending.");
+			value("net11_output_queued_bytes",tcp::output_queued());
+			request_counters r=request_totals();
+			metric("net11_http_requests_total","counter","HTTP requests routed.");
+			value("net11_http_requests_total",r.requests);
+			metric("net11_http_responses_total","counter","HTTP responses by status class.");
+			for (int i=1;i<6;i++) {
+				std::string labels="{code=\""+std::to_string(i)+"xx\"}";
+				value("net11_http_responses_total",r.responses[i],labels.c_str());
+			}
+			metric("net11_http_not_found_total","counter","HTTP requests without a route.");
+			value("net11_http_not_found_total",r.not_found);
+			metric("net11_http_bad_requests_total","counter","HTTP requests that failed to parse.");
+			value("net11_http_bad_requests_total",r.bad_requests);
+			metric("net11_websocket_frames_received_total","counter","Websocket frames received.");
+			value("net11_websocket_frames_received_total",r.frames_in);
+			metric("net11_websocket_frames_sent_total","counter","Websocket frames sent.");
+			value("net11_websocket_frames_sent_total",r.frames_out);
+			return out;
+		}
+
+		// serves metrics_text() on the url for Prometheus to scrape
+		response match_metrics(connection &c,const std::string &url="/metrics") {
+			if (c.url()!=url)
+				return 0;
+			auto out=make_text_response(200,metrics_text());
+			out->set_header("content-type","text/plain; version=0.0.4");
+			return out;
+		}
+
+		// A router matches the path of a request against its patterns in a
+		// radix tree, so that the cost follows the length of the path rather
+		// than the number of routes. A pattern segment starting with : matches
+		// any one segment and * (optionally named, as in *rest) matches the
+		// rest of the path. Static segments win over parameters and those over
+		// a *, the captures are read with connection::param(). Routes are added
+		// before the router is passed to start_server, matching is read-only
+		// so one router can serve all loops of a tcp_group.
+		//
+		//    net11::http::router r;
+		//    r.get("/users/:id",[](net11::http::connection &c)->net11::http::action {
+		//        return net11::http::make_text_response(200,"user "+c.param("id").str());
+		//    });
+		//    net11::http::start_server(l,8080,r);
+		//
+		// Requests without a route go to the otherwise() function, if that's
+		// missing or returns null the response is a 404 or, for paths that are
+		// routed for other methods, a 405.
+		class router {
+		public:
+			typedef std::function<action(connection &c)> handler;
+		private:
+			enum node_kind {
+				static_node,
+				param_node,
+				wild_node
+			};
+			struct endpoint {
+				std::vector<std::string> names;
+				// handlers by method, an empty method takes any
+				std::vector<std::pair<std::string,handler>> methods;
+			};
+			struct node {
+				node_kind kind;
+				std::string prefix;   // the characters a static node matches
+				std::string firsts;   // the first character of each static child
+				std::vector<int> kids;
+				int param=-1;
+				int wild=-1;
+				int ep=-1;            // the endpoint of routes ending here
+			};
+			std::vector<node> nodes;
+			std::vector<endpoint> endpoints;
+			handler fallback;
+
+			int add_node(node_kind kind,const std::string &prefix) {
+				node n;
+				n.kind=kind;
+				n.prefix=prefix;
+				nodes.push_back(n);
+				return (int)nodes.size()-1;
+			}
+			// follows or inserts the static text below a node, splitting a
+			// child when the text only shares the start of its prefix
+			int insert_static(int cur,std::string text) {
+				while (text.size()) {
+					size_t k=nodes[cur].firsts.find(text[0]);
+					if (k==std::string::npos) {
+						int n=add_node(static_node,text);
+						nodes[cur].firsts.push_back(text[0]);
+						nodes[cur].kids.push_back(n);
+						return n;
+					}
+					int kid=nodes[cur].kids[k];
+					const std::string &kp=nodes[kid].prefix;
+					size_t common=0;
+					while (common<kp.size() && common<text.size() && kp[common]==text[common])
+						common++;
+					if (common<kp.size()) {
+						int tail=add_node(static_node,kp.substr(common));
+						node &t=nodes[tail];
+						node &k=nodes[kid];
+						t.firsts.swap(k.firsts);
+						t.kids.swap(k.kids);
+						std::swap(t.param,k.param);
+						std::swap(t.wild,k.wild);
+						std::swap(t.ep,k.ep);
+						k.prefix.resize(common);
+						k.firsts.push_back(t.prefix[0]);
+						k.kids.push_back(tail);
+					}
+					text=text.substr(common);
+					cur=kid;
+				}
+				return cur;
+			}
+			// walks the tree with backtracking, false if nothing matched
+			bool match(int n,const char *p,size_t len,size_t pos,connection &c,int depth,const endpoint *&out) const {
+				const node &x=nodes[n];
+				if (pos==len && x.ep>=0) {
+					out=&endpoints[x.ep];
+					c.param_count=depth;
+					return true;
+				}
+				if (pos<len) {
+					size_t k=x.firsts.find(p[pos]);
+					if (k!=std::string::npos) {
+						const node &kid=nodes[x.kids[k]];
+						if (kid.prefix.size()<=len-pos && !memcmp(p+pos,kid.prefix.data(),kid.prefix.size()) &&
+							match(x.kids[k],p,len,pos+kid.prefix.size(),c,depth,out))
+							return true;
+					}
+					if (x.param>=0) {
+						const char *slash=(const char*)memchr(p+pos,'/',len-pos);
+						size_t end=slash?slash-p:len;
+						if (end>pos) {
+							c.param_values[depth]=string_ref(p+pos,end-pos);
+							if (match(x.param,p,len,end,c,depth+1,out))
+								return true;
+						}
+					}
+				}
+				if (x.wild>=0) {
+					c.param_values[depth]=string_ref(p+pos,len-pos);
+					out=&endpoints[nodes[x.wild].ep];
+					c.param_count=depth+1;
+					return true;
+				}
+				return false;
+			}
+		public:
+			router() {
+				add_node(static_node,"");
+			}
+			// adds a handler for a method (empty for any) and pattern, returns
+			// true if the pattern is invalid or already has a handler for it.
+			bool add(const std::string &method,const std::string &pattern,handler h) {
+				if (pattern.empty() || pattern[0]!='/')
+					return true;
+				std::vector<std::string> names;
+				int cur=0;
+				size_t i=0;
+				while (i<pattern.size()) {
+					char ch=pattern[i];
+					if ((ch==':' || ch=='*') && pattern[i-1]=='/') {
+						size_t end=pattern.find('/',i);
+						if (end==std::string::npos)
+							end=pattern.size();
+						// a * ends the pattern and a : needs a name
+						if (ch=='*' ? end!=pattern.size() : end==i+1)
+							return true;
+						if (names.size()==(size_t)connection::max_params)
+							return true;
+						names.push_back(ch=='*' && end==i+1?std::string("*"):pattern.substr(i+1,end-i-1));
+						int next=ch==':'?nodes[cur].param:nodes[cur].wild;
+						if (next<0) {
+							next=add_node(ch==':'?param_node:wild_node,"");
+							if (ch==':')
+								nodes[cur].param=next;
+							else
+								nodes[cur].wild=next;
+						}
+						cur=next;
+						i=end;
+						continue;
+					}
+					size_t end=i+1;
+					while (end<pattern.size() && !((pattern[end]==':' || pattern[end]=='*') && pattern[end-1]=='/'))
+						end++;
+					cur=insert_static(cur,pattern.substr(i,end-i));
+					i=end;
+				}
+				if (nodes[cur].ep<0) {
+					nodes[cur].ep=(int)endpoints.size();
+					endpoints.push_back(endpoint());
+					endpoints.back().names=names;
+				} else if (endpoints[nodes[cur].ep].names!=names) {
+					// the captures of a path are read by the names of its first route
+					return true;
+				}
+				for (auto &m:endpoints[nodes[cur].ep].methods) {
+					if (m.first==method)
+						return true;
+				}
+				endpoints[nodes[cur].ep].methods.push_back(std::make_pair(method,h));
+				return false;
+			}
+			bool get(const std::string &pattern,handler h) {
+				return add("GET",pattern,h);
+			}
+			bool post(const std::string &pattern,handler h) {
+				return add("POST",pattern,h);
+			}
+			bool put(const std::string &pattern,handler h) {
+				return add("PUT",pattern,h);
+			}
+			bool del(const std::string &pattern,handler h) {
+				return add("DELETE",pattern,h);
+			}
+			bool any(const std::string &pattern,handler h) {
+				return add("",pattern,h);
+			}
+			// called for requests that no route matched (websockets, files etc)
+			void otherwise(handler h) {
+				fallback=h;
+			}
+			// the route function, the query string isn't part of the matched path
+			action operator()(connection &c) const {
+				string_ref url=c.url_ref();
+				size_t q=url.find('?');
+				size_t len=q==string_ref::npos?url.size():q;
+				const endpoint *ep=nullptr;
+				if (match(0,url.data(),len,0,c,0,ep)) {
+					c.param_names=&ep->names;
+					const handler *any_method=nullptr;
+					string_ref method=c.method_ref();
+					for (auto &m:ep->methods) {
+						if (method==m.first)
+							return m.second(c);
+						if (m.first.empty())
+							any_method=&m.second;
+					}
+					if (any_method)
+						return (*any_method)(c);
+				}
+				c.param_count=0;
+				if (fallback) {
+					if (action a=fallback(c))
+						return a;
+				}
+				if (ep) {
+					std::string allow;
+					for (auto &m:ep->methods)
+						allow+=(allow.size()?", ":"")+m.first;
+					auto r=make_text_response(405,"Error 405, "+c.method_ref().str()+" not allowed");
+					r->set_header("allow",allow);
+					return r;
+				}
+				return nullptr;
+			}
+		};
+
+		// Route tables for servers whose urls are fixed at build time. The
+		// paths are constexpr char arrays and the handlers plain functions, the
+		// table is compiled into the route() of its connections as a chain of
+		// length and memcmp checks on constants, without std::function calls.
+		//
+		//    constexpr char hello_path[]="/hello";
+		//    net11::http::action hello(net11::http::connection &c) {
+		//        return net11::http::make_text_response(200,"Hello world!");
+		//    }
+		//    using routes=net11::http::route_table<
+		//        net11::http::static_route<hello_path,hello,net11::http::get_method>
+		//    >;
+		//    net11::http::start_server<routes>(l,8080);
+		//
+		// The routes are tried in order and the first match handles the request.
+		enum route_method {
+			any_method=0,
+			get_method,
+			head_method,
+			post_method,
+			put_method,
+			delete_method,
+			patch_method,
+			options_method
+		};
+		constexpr const char* route_method_name(route_method m) {
+			return m==get_method?"GET":
+				m==head_method?"HEAD":
+				m==post_method?"POST":
+				m==put_method?"PUT":
+				m==delete_method?"DELETE":
+				m==patch_method?"PATCH":
+				m==options_method?"OPTIONS":"";
+		}
+		constexpr size_t static_length(const char *str) {
+			return *str?1+static_length(str+1):0;
+		}
+		// an exact path and optionally a method
+		template<const char *PATH,action (*HANDLER)(connection &c),route_method METHOD=any_method>
+		struct static_route {
+			static constexpr size_t path_length=static_length(PATH);
+			static constexpr size_t method_length=static_length(route_method_name(METHOD));
+			static bool matches(string_ref method,string_ref path) {
+				return path.size()==path_length && 0==memcmp(path.data(),PATH,path_length) &&
+					(METHOD==any_method || (method.size()==method_length && 0==memcmp(method.data(),route_method_name(METHOD),method_length)));
+			}
+			static action handle(connection &c) {
+				return HANDLER(c);
+			}
+		};
+		// takes every request that reaches it, for example files as the last route
+		template<action (*HANDLER)(connection &c)>
+		struct static_otherwise {
+			static bool matches(string_ref,string_ref) {
+				return true;
+			}
+			static action handle(connection &c) {
+				return HANDLER(c);
+			}
+		};
+		template<class... ROUTES>
+		struct route_chain;
+		template<>
+		struct route_chain<> {
+			static action dispatch(connection &,string_ref,string_ref) {
+				return nullptr;
+			}
+		};
+		template<class ROUTE,class... REST>
+		struct route_chain<ROUTE,REST...> {
+			static action dispatch(connection &c,string_ref method,string_ref path) {
+				if (ROUTE::matches(method,path))
+					return ROUTE::handle(c);
+				return route_chain<REST...>::dispatch(c,method,path);
+			}
+		};
+		template<class... ROUTES>
+		struct route_table {
+			// the query string isn't part of the matched path
+			static action dispatch(connection &c) {
+				string_ref url=c.url_ref();
+				size_t q=url.find('?');
+				return route_chain<ROUTES...>::dispatch(c,c.method_ref(),q==string_ref::npos?url:url.substr(0,q));
+			}
+		};
+
+		template<class ROUTES>
+		class static_connection final : public connection {
+			friend class net11::pool<static_connection>;
+			static_connection(tcp::connection *tcp_conn):connection(tcp_conn,nullptr) {}
+			void reuse(tcp::connection *tcp_conn) {
+				connection::reuse(tcp_conn,nullptr);
+			}
+			virtual action route() override {
+				return ROUTES::dispatch(*this);
+			}
+			// recycled per thread like connection_pool()
+			static net11::pool<static_connection>& pool() {
+				static thread_local net11::pool<static_connection> p;
+				return p;
+			}
+		public:
+			// the spawn function of a server, see make_server<ROUTES>()
+			static void spawn(net11::tcp::connection *tconn) {
+				connection::attach(tconn,pool().create(tconn),[](static_connection *p) {
+					pool().release(p);
+				});
+			}
+			// counters for the connection objects of this table on the calling thread
+			static net11::pool_stats stats() {
+				return pool().stats();
+			}
+		};
+
+		template<class ROUTES>
+		std::function<void(net11::tcp::connection*)> make_server() {
+			return &static_connection<ROUTES>::spawn;
+		}
+
+		template<class ROUTES>
+		bool start_server(net11::tcp& l,int port) {
+			return l.listen(port,make_server<ROUTES>());
+		}
+
+#ifndef _MSC_VER
+		template<class ROUTES>
+		bool start_server(net11::tcp& l,const std::string &path) {
+			return l.listen(path,make_server<ROUTES>());
+		}
+#endif
+
+		template<class ROUTES>
+		bool start_server(net11::tcp_group& g,int port) {
+			return g.listen(port,make_server<ROUTES>());
 		}
 
 
@@ -987,6 +1965,7 @@ namespace net11 {
 				consume_fun=nullptr;
 				if (!act) {
 					//std::map<std::string,std::string> head; //{{"connection","close"}};
+					thread_requests().not_found.add();
 					std::string msg="Error 404, "+url()+" not found";
 					act=(action)make_text_response(404,msg);
 				}
@@ -998,18 +1977,25 @@ namespace net11 {
 
 			inline void responsedata::produce_headers(connection &conn) {
 				conn.produced=true;
+				if (code>=100 && code<600)
+					thread_requests().responses[code/100].add();
 				std::string resline="HTTP/1.1 "+std::to_string(code)+" OK\r\n";
+				bool has_connection=false;
 				for(auto kv:head) {
 					resline=resline+kv.first+": "+kv.second+"\r\n";
+					has_connection|=net11::strieq(kv.first,"connection");
 				}
+				// tell the client not to reuse a connection that will be closed
+				if (conn.draining && !has_connection)
+					resline+="Connection: close\r\n";
 				resline+="\r\n";
-				conn.tconn->producers.push_back(make_data_producer(resline));
+				conn.tconn->send(make_data_producer(resline));
 			}
 
 			inline bool responsedata::produce(connection &conn) {
 				produce_headers(conn);
 				if (head.count("content-length")) {
-					conn.tconn->producers.push_back(prod);
+					conn.tconn->send(prod);
 				} else {
 					// TODO: implement chunked responses?
 					abort(); //conn.producers.push_back([this](
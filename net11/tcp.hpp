@@ -2,26 +2,38 @@
 
 #include <functional>
 #include <exception>
+#include <stdexcept>
+#include <memory>
 #include <vector>
 #include <array>
 #include <utility>
 
 #include <algorithm>
 #include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <cstdlib>
 
 //#include <stdio.h>
 
 //#define NET11_VERBOSE
 
-#ifdef _MSC_VER
-
-//#define NET11_OVERLAPPED
 #ifdef NET11_VERBOSE
 #define NET11_TCP_LOG(...) fprintf(stderr,__VA_ARGS__);
 #else
 #define NET11_TCP_LOG(...)
 #endif
 
+#ifdef _MSC_VER
+
+//#define NET11_OVERLAPPED
+
 // remove problematic windows min / max macros
 #ifndef NOMINMAX
 #define NOMINMAX
@@ -38,13 +50,64 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #define closesocket(x) close(x)
 #endif
 
+// On Linux readiness is tracked with an edge triggered epoll set so that only
+// connections with pending events are visited, define NET11_NO_EPOLL to get
+// the portable loop that scans every connection on each poll.
+// Defining NET11_IO_URING instead selects a completion based io_uring backend
+// (needs Linux 6.0+ for multishot receives with provided buffer rings).
+#if defined(NET11_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#elif defined(__linux__) && !defined(NET11_OVERLAPPED) && !defined(NET11_NO_EPOLL)
+#define NET11_EPOLL
+#include <sys/epoll.h>
+#endif
+
+// sends followed by more output are flagged so that the kernel fills whole segments
+#ifdef MSG_MORE
+#define NET11_MSG_MORE MSG_MORE
+#else
+#define NET11_MSG_MORE 0
+#endif
+
+// file producers are sent with sendfile by the readiness based loops on Linux
+#if defined(__linux__) && !defined(NET11_IO_URING)
+#define NET11_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+// Define NET11_MIRRORED_BUFFERS to back connection buffers with double mapped
+// rings (Linux only), the input and output sizes are rounded up to whole pages.
+#if defined(NET11_MIRRORED_BUFFERS) && !defined(__linux__)
+#undef NET11_MIRRORED_BUFFERS
+#endif
+
+// both event backends only visit connections that have been woken up
+#if defined(NET11_EPOLL) || defined(NET11_IO_URING)
+#define NET11_ACTIVE_LIST
+#endif
+
+#ifndef NET11_IO_URING_ENTRIES
+#define NET11_IO_URING_ENTRIES 4096
+#endif
+#ifndef NET11_IO_URING_BUFFERS
+#define NET11_IO_URING_BUFFERS 1024
+#endif
+
 // include net11 utilities
 #include "util.hpp"
 
@@ -54,19 +117,628 @@ namespace net11 {
 	// a single connection, protocols should inherit this class
 	class connection;
 
+#ifdef NET11_IO_URING
+	// Minimal io_uring wrapper, maps the submission and completion rings and
+	// manages one provided buffer ring that multishot receives pick buffers from.
+	class uring {
+		int fd=-1;
+		void *ring_ptr=nullptr;
+		size_t ring_size=0;
+		unsigned sq_entries=0;
+		unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+		unsigned *cq_head,*cq_tail,*cq_mask;
+		struct io_uring_sqe *sqes=nullptr;
+		struct io_uring_cqe *cqes;
+		// tail including entries prepared but not yet handed to the kernel
+		unsigned sq_local_tail;
+
+		struct io_uring_buf_ring *br=nullptr;
+		size_t br_size;
+		unsigned short br_tail;
+		unsigned short br_added;
+		char *buf_data=nullptr;
+		int buf_size;
+		int buf_count;
+		int buf_held=0;   // buffers handed out by the kernel and not yet returned
+
+		uring(const uring &)=delete;
+		uring& operator=(const uring&)=delete;
+
+		static int sys_enter(int fd,unsigned to_submit,unsigned min_complete,unsigned flags) {
+			return (int)syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,nullptr,0);
+		}
+	public:
+		static const int buffer_group=1;
+
+		uring() {}
+		~uring() {
+			if (fd!=-1)
+				close(fd);
+			if (buf_data)
+				delete[] buf_data;
+			if (br)
+				munmap(br,br_size);
+			if (sqes)
+				munmap(sqes,sq_entries*sizeof(struct io_uring_sqe));
+			if (ring_ptr)
+				munmap(ring_ptr,ring_size);
+		}
+		void setup(unsigned entries,int in_buf_count,int in_buf_size) {
+			struct io_uring_params p;
+			memset(&p,0,sizeof(p));
+			// multishot operations post many completions per submission
+			p.flags=IORING_SETUP_CQSIZE;
+			p.cq_entries=entries*4;
+			fd=(int)syscall(__NR_io_uring_setup,entries,&p);
+			if (fd<0)
+				throw std::runtime_error("io_uring_setup failed");
+			if (!(p.features&IORING_FEAT_SINGLE_MMAP) || !(p.features&IORING_FEAT_NODROP) || !(p.features&IORING_FEAT_EXT_ARG))
+				throw std::runtime_error("io_uring kernel support too old");
+			sq_entries=p.sq_entries;
+			size_t sqsz=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+			size_t cqsz=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+			ring_size=sqsz>cqsz?sqsz:cqsz;
+			ring_ptr=mmap(nullptr,ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+			if (ring_ptr==MAP_FAILED) {
+				ring_ptr=nullptr;
+				throw std::runtime_error("io_uring ring mmap failed");
+			}
+			void *sqp=mmap(nullptr,sq_entries*sizeof(struct io_uring_sqe),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+			if (sqp==MAP_FAILED)
+				throw std::runtime_error("io_uring sqe mmap failed");
+			sqes=(struct io_uring_sqe*)sqp;
+			char *r=(char*)ring_ptr;
+			sq_head=(unsigned*)(r+p.sq_off.head);
+			sq_tail=(unsigned*)(r+p.sq_off.tail);
+			sq_mask=(unsigned*)(r+p.sq_off.ring_mask);
+			sq_array=(unsigned*)(r+p.sq_off.array);
+			cq_head=(unsigned*)(r+p.cq_off.head);
+			cq_tail=(unsigned*)(r+p.cq_off.tail);
+			cq_mask=(unsigned*)(r+p.cq_off.ring_mask);
+			cqes=(struct io_uring_cqe*)(r+p.cq_off.cqes);
+			sq_local_tail=*sq_tail;
+
+			// register the provided buffer ring used for all receives
+			buf_count=in_buf_count;
+			buf_size=in_buf_size;
+			br_size=buf_count*sizeof(struct io_uring_buf);
+			void *brp=mmap(nullptr,br_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+			if (brp==MAP_FAILED)
+				throw std::runtime_error("io_uring buffer ring mmap failed");
+			br=(struct io_uring_buf_ring*)brp;
+			struct io_uring_buf_reg reg;
+			memset(&reg,0,sizeof(reg));
+			reg.ring_addr=(uint64_t)(uintptr_t)br;
+			reg.ring_entries=buf_count;
+			reg.bgid=buffer_group;
+			if (syscall(__NR_io_uring_register,fd,IORING_REGISTER_PBUF_RING,&reg,1))
+				throw std::runtime_error("io_uring provided buffer ring registration failed");
+			buf_data=new char[(size_t)buf_count*buf_size];
+			br_tail=0;
+			br_added=0;
+			buf_held=buf_count;
+			for (int i=0;i<buf_count;i++)
+				return_buffer(i);
+			publish_buffers();
+		}
+		// get a cleared submission entry, flushes to the kernel if the ring is full
+		struct io_uring_sqe* get_sqe() {
+			if (sq_local_tail-__atomic_load_n(sq_head,__ATOMIC_ACQUIRE)>=sq_entries) {
+				submit(0);
+				if (sq_local_tail-__atomic_load_n(sq_head,__ATOMIC_ACQUIRE)>=sq_entries)
+					abort(); // the kernel didn't consume submissions, invalid state
+			}
+			unsigned idx=sq_local_tail&*sq_mask;
+			struct io_uring_sqe *sqe=&sqes[idx];
+			memset(sqe,0,sizeof(*sqe));
+			sq_array[idx]=idx;
+			sq_local_tail++;
+			return sqe;
+		}
+		// hands all prepared entries to the kernel in one call, optionally waiting
+		// up to timeout milliseconds (-1 for no limit) for a completion.
+		int submit(unsigned wait_nr,int timeout=-1) {
+			unsigned to_submit=sq_local_tail-*sq_tail;
+			__atomic_store_n(sq_tail,sq_local_tail,__ATOMIC_RELEASE);
+			if (wait_nr && timeout>=0) {
+				struct __kernel_timespec ts;
+				ts.tv_sec=timeout/1000;
+				ts.tv_nsec=(timeout%1000)*1000000LL;
+				struct io_uring_getevents_arg arg;
+				memset(&arg,0,sizeof(arg));
+				arg.ts=(uint64_t)(uintptr_t)&ts;
+				return (int)syscall(__NR_io_uring_enter,fd,to_submit,wait_nr,IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,&arg,sizeof(arg));
+			}
+			return sys_enter(fd,to_submit,wait_nr,IORING_ENTER_GETEVENTS);
+		}
+		// invokes fn(user_data,res,flags) for each completion available
+		template<class FN>
+		void reap(FN fn) {
+			unsigned head=*cq_head;
+			while(head!=__atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe *cqe=&cqes[head&*cq_mask];
+				uint64_t ud=cqe->user_data;
+				int res=cqe->res;
+				unsigned flags=cqe->flags;
+				head++;
+				__atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+				fn(ud,res,flags);
+			}
+		}
+		char* buffer_data(unsigned short bid) {
+			return buf_data+(size_t)bid*buf_size;
+		}
+		int buffers_free() {
+			return buf_count-buf_held;
+		}
+		// record that the kernel handed us a buffer
+		void took_buffer() {
+			buf_held++;
+		}
+		// queue a buffer to be given back to the kernel on the next publish
+		void return_buffer(unsigned short bid) {
+			// index from the ring base, in C++ the flexible bufs member of the
+			// header gets offset by the empty struct used to declare it.
+			struct io_uring_buf *b=((struct io_uring_buf*)br)+((br_tail+br_added)&(buf_count-1));
+			b->addr=(uint64_t)(uintptr_t)buffer_data(bid);
+			b->len=buf_size;
+			b->bid=bid;
+			br_added++;
+			buf_held--;
+		}
+		// makes returned buffers visible to the kernel, returns the number published
+		int publish_buffers() {
+			int count=br_added;
+			if (!count)
+				return 0;
+			br_tail+=br_added;
+			br_added=0;
+			__atomic_store_n(&br->tail,br_tail,__ATOMIC_RELEASE);
+			return count;
+		}
+	};
+#endif
+
+#ifndef _MSC_VER
+	// Looks up host names with getaddrinfo on a background thread so that slow
+	// DNS answers never stall a loop, finished lookups are collected with take()
+	// and the loop is woken up by writing to the given descriptor.
+	class resolver {
+	public:
+		struct address {
+			struct sockaddr_storage addr;
+			socklen_t len;
+		};
+		struct result {
+			std::string host;
+			std::vector<address> addrs; // empty if the lookup failed
+		};
+	private:
+		// shared with the thread since a lookup can outlive the resolver
+		struct state {
+			std::mutex lock;
+			std::condition_variable cond;
+			std::deque<std::string> requests;
+			std::vector<result> results;
+			int wake_fd;
+			bool stop=false;
+		};
+		std::shared_ptr<state> st;
+		resolver(const resolver &)=delete;
+		resolver& operator=(const resolver&)=delete;
+
+		static void run(std::shared_ptr<state> st) {
+			std::unique_lock<std::mutex> lk(st->lock);
+			while (!st->stop) {
+				if (st->requests.empty()) {
+					st->cond.wait(lk);
+					continue;
+				}
+				result r;
+				r.host=st->requests.front();
+				st->requests.pop_front();
+				lk.unlock();
+				struct addrinfo hints,*res=nullptr;
+				memset(&hints,0,sizeof(hints));
+				hints.ai_family=AF_UNSPEC;
+				hints.ai_socktype=SOCK_STREAM;
+				if (0==getaddrinfo(r.host.c_str(),nullptr,&hints,&res)) {
+					for (struct addrinfo *ai=res;ai;ai=ai->ai_next) {
+						address a;
+						memset(&a,0,sizeof(a));
+						memcpy(&a.addr,ai->ai_addr,ai->ai_addrlen);
+						a.len=ai->ai_addrlen;
+						r.addrs.push_back(a);
+					}
+					freeaddrinfo(res);
+				}
+				lk.lock();
+				if (st->stop)
+					break;
+				st->results.push_back(std::move(r));
+				char c=0;
+				if (write(st->wake_fd,&c,1)) {}
+			}
+		}
+	public:
+		resolver(int wake_fd):st(new state()) {
+			st->wake_fd=wake_fd;
+			std::thread(run,st).detach();
+		}
+		~resolver() {
+			// the thread might be stuck in getaddrinfo, it exits on its own later
+			std::lock_guard<std::mutex> lk(st->lock);
+			st->stop=true;
+			st->wake_fd=-1;
+			st->cond.notify_one();
+		}
+		void request(const std::string &host) {
+			std::lock_guard<std::mutex> lk(st->lock);
+			st->requests.push_back(host);
+			st->cond.notify_one();
+		}
+		// moves finished lookups to out
+		void take(std::vector<result> &out) {
+			std::lock_guard<std::mutex> lk(st->lock);
+			out.swap(st->results);
+		}
+		// parses IPv4 and IPv6 literals without a lookup
+		static bool parse_numeric(const std::string &host,address &out) {
+			memset(&out,0,sizeof(out));
+			struct sockaddr_in *in4=(struct sockaddr_in*)&out.addr;
+			if (1==inet_pton(AF_INET,host.c_str(),&in4->sin_addr)) {
+				in4->sin_family=AF_INET;
+				out.len=sizeof(*in4);
+				return true;
+			}
+			struct sockaddr_in6 *in6=(struct sockaddr_in6*)&out.addr;
+			if (1==inet_pton(AF_INET6,host.c_str(),&in6->sin6_addr)) {
+				in6->sin6_family=AF_INET6;
+				out.len=sizeof(*in6);
+				return true;
+			}
+			return false;
+		}
+		// a unix domain socket path, a leading @ selects the abstract namespace (Linux)
+		static bool parse_unix(const std::string &path,address &out) {
+			memset(&out,0,sizeof(out));
+			struct sockaddr_un *un=(struct sockaddr_un*)&out.addr;
+			if (path.empty() || path.size()>=sizeof(un->sun_path))
+				return false;
+			un->sun_family=AF_UNIX;
+			memcpy(un->sun_path,path.data(),path.size());
+			if (path[0]=='@') {
+				// abstract names aren't terminated, the length covers the name exactly
+				un->sun_path[0]=0;
+				out.len=offsetof(struct sockaddr_un,sun_path)+path.size();
+			} else {
+				out.len=offsetof(struct sockaddr_un,sun_path)+path.size()+1;
+			}
+			return true;
+		}
+	};
+#endif
+
+	// the outcome of queueing output on a connection, only send_closed
+	// converts to false.
+	enum send_result {
+		send_closed=0, // the connection is gone, nothing was queued
+		send_ok,       // queued
+		send_full,     // queued but the connection is at its high water mark
+		send_dropped   // not queued since the output budget is used up
+	};
+
 	class tcp {
 	public:
 		class connection;
+		// the maximum number of blocks gathered into one send
+		static const int max_iov=64;
+		// options for connection sockets, zero values keep the system defaults
+		struct socket_options {
+			bool no_delay;          // TCP_NODELAY, send small writes at once
+			int send_buffer;        // SO_SNDBUF in bytes
+			int receive_buffer;     // SO_RCVBUF in bytes
+			// SO_KEEPALIVE with probes after keepalive_idle seconds without
+			// traffic, keepalive_interval seconds apart and giving up after
+			// keepalive_count probes (the interval and count where supported).
+			int keepalive_idle;
+			int keepalive_interval;
+			int keepalive_count;
+			socket_options():no_delay(false),send_buffer(0),receive_buffer(0),keepalive_idle(0),keepalive_interval(0),keepalive_count(0) {}
+		};
+		// optional settings for listening sockets
+		struct listen_options {
+			// let several sockets (usually one per event loop thread) bind the
+			// same port with the kernel spreading new connections between them.
+			bool reuse_port;
+			// seconds the kernel may hold a connection until the client sends
+			// data, the loop then never wakes up for idle connects (Linux only).
+			int defer_accept;
+			// the most connections accepted per loop turn before returning to
+			// established connections, 0 for no limit (not used with io_uring
+			// where the kernel accepts on its own).
+			int accept_budget;
+			// connection timeouts in milliseconds, 0 disables them. Idle counts
+			// from the last input or output, header from when a protocol starts
+			// its header timer (see connection::start_header_timer) and write
+			// from when output got stuck without the peer taking any of it.
+			int idle_timeout;
+			int header_timeout;
+			int write_timeout;
+			// queued output bytes where send() starts reporting send_full and
+			// where on_writable is called once the queue has drained again.
+			size_t high_water;
+			size_t low_water;
+			// messages (pipelined requests) the sink may read in one turn while
+			// output for earlier ones is still queued, their output then leaves
+			// in one send. 0 reads the next message once the output has left.
+			int pipeline_depth;
+			// applied to each accepted connection, buffer sizes are also set on
+			// the listening socket so that the window scale fits them.
+			socket_options socket;
+			listen_options():reuse_port(false),defer_accept(0),accept_budget(64),idle_timeout(0),header_timeout(0),write_timeout(0),high_water(1024*1024),low_water(256*1024),pipeline_depth(16) {}
+		};
+		// what happens to connections when the output budget is used up
+		enum budget_policy {
+			budget_drop,      // output to connections above their low water mark is dropped
+			budget_disconnect // connections with the most queued output are closed
+		};
+		struct timeout_counters {
+			uint64_t idle;
+			uint64_t header;
+			uint64_t write;
+		};
+		struct accept_counters {
+			uint64_t accepted; // connections handed to spawn functions
+			uint64_t shed;     // connections closed at once since descriptors ran out
+			uint64_t errors;   // other failed accepts
+			uint64_t deferred; // times the budget ran out with connections still waiting
+		};
+		struct output_counters {
+			uint64_t full;    // sends that reached the high water mark
+			uint64_t dropped; // sends dropped by the output budget
+			uint64_t closed;  // connections closed by the output budget
+		};
+		struct traffic_counters {
+			uint64_t accepted;  // connections taken from listeners
+			uint64_t connected; // outgoing connections established
+			uint64_t closed;
+			uint64_t bytes_in;
+			uint64_t bytes_out;
+		};
 	private:
-		std::vector<std::pair<int, std::function<void(connection*)>>> listeners;
+		struct listener {
+			int sock;
+			int budget;
+			int idle_timeout=0;
+			int header_timeout=0;
+			int write_timeout=0;
+			size_t high_water=0;
+			size_t low_water=0;
+			int pipeline_depth=16;
+			socket_options sockopts;
+			bool backlog=false; // budget ran out, more connections may be waiting
+			bool closing=false; // closed by a drain, io_uring waits for the accept to end
+			std::string unix_path; // socket file removed when the listener goes away
+			std::function<void(connection*)> spawn;
+			listener(int in_sock,int in_budget,std::function<void(connection*)> in_spawn):sock(in_sock),budget(in_budget),spawn(in_spawn) {}
+		};
+		std::vector<std::unique_ptr<listener>> listeners;
+		accept_counters acc_stats;
+		// traffic counts of the loop, other threads read them through the registry
+		struct traffic_block {
+			net11::counter accepted;
+			net11::counter connected;
+			net11::counter closed;
+			net11::counter bytes_in;
+			net11::counter bytes_out;
+			void sum(traffic_counters &out) const {
+				out.accepted+=accepted.get();
+				out.connected+=connected.get();
+				out.closed+=closed.get();
+				out.bytes_in+=bytes_in.get();
+				out.bytes_out+=bytes_out.get();
+			}
+		};
+		traffic_block traffic;
+		static net11::counter_registry<traffic_block,traffic_counters>& traffic_registry() {
+			static net11::counter_registry<traffic_block,traffic_counters> registry;
+			return registry;
+		}
+		// set by drain() from any thread, the drain starts on the next poll
+		std::atomic<int> drain_request{-1}; // the timeout, -1 when not requested
+		bool draining=false;
+		uint64_t drain_deadline=0;
+#ifdef NET11_IO_URING
+		// listeners closed by a drain until their multishot accept has ended
+		std::vector<std::unique_ptr<listener>> retired;
+#endif
+#ifndef _MSC_VER
+		// the listening sockets of the process that can be passed on to a new
+		// process and the ones passed to this one that listen() adopts.
+		struct handover_state {
+			std::mutex lock;
+			std::set<int> listening;
+			std::vector<int> inherited;
+			bool loaded=false;
+			std::atomic<int> ready_sock{-1}; // closed on the first poll to tell the old process
+		};
+		static handover_state& handovers() {
+			static handover_state state;
+			return state;
+		}
+		static bool same_address(const resolver::address &want,const struct sockaddr_storage &ss,socklen_t len) {
+			if (want.addr.ss_family!=ss.ss_family)
+				return false;
+			if (ss.ss_family==AF_INET) {
+				const struct sockaddr_in *a=(const struct sockaddr_in*)&want.addr;
+				const struct sockaddr_in *b=(const struct sockaddr_in*)&ss;
+				return a->sin_port==b->sin_port && a->sin_addr.s_addr==b->sin_addr.s_addr;
+			}
+			if (ss.ss_family==AF_UNIX)
+				return want.len==len && 0==memcmp(&want.addr,&ss,len);
+			return false;
+		}
+		// takes an inherited listening socket bound to the address, -1 if none
+		static int adopt_listener(const resolver::address &want) {
+			handover_state &st=handovers();
+			std::lock_guard<std::mutex> guard(st.lock);
+			if (!st.loaded) {
+				st.loaded=true;
+				// a parent that called share_listeners() lists them in the environment
+				if (const char *env=getenv("NET11_LISTEN_FDS")) {
+					for (const char *p=env;*p;) {
+						char *end;
+						long fd=strtol(p,&end,10);
+						if (end==p)
+							break;
+						if (fd>=0 && -1!=fcntl((int)fd,F_SETFD,FD_CLOEXEC))
+							st.inherited.push_back((int)fd);
+						p=*end?end+1:end;
+					}
+					unsetenv("NET11_LISTEN_FDS");
+				}
+			}
+			for (size_t i=0;i<st.inherited.size();i++) {
+				int fd=st.inherited[i];
+				struct sockaddr_storage ss;
+				socklen_t len=sizeof(ss);
+				int accepting=0;
+				socklen_t alen=sizeof(accepting);
+				if (getsockname(fd,(struct sockaddr*)&ss,&len) || getsockopt(fd,SOL_SOCKET,SO_ACCEPTCONN,&accepting,&alen) || !accepting)
+					continue;
+				if (same_address(want,ss,len)) {
+					st.inherited.erase(st.inherited.begin()+i);
+					return fd;
+				}
+			}
+			return -1;
+		}
+		// passes every listening socket of the process with one SCM_RIGHTS message
+		static bool send_listeners(int sock) {
+			std::vector<int> fds;
+			{
+				std::lock_guard<std::mutex> guard(handovers().lock);
+				fds.assign(handovers().listening.begin(),handovers().listening.end());
+			}
+			if (fds.size()>max_handover)
+				fds.resize(max_handover);
+			char count=(char)fds.size();
+			struct iovec iov;
+			iov.iov_base=&count;
+			iov.iov_len=1;
+			struct msghdr msg;
+			memset(&msg,0,sizeof(msg));
+			msg.msg_iov=&iov;
+			msg.msg_iovlen=1;
+			std::vector<char> ctrl(CMSG_SPACE(sizeof(int)*fds.size()));
+			if (fds.size()) {
+				msg.msg_control=ctrl.data();
+				msg.msg_controllen=ctrl.size();
+				struct cmsghdr *cm=CMSG_FIRSTHDR(&msg);
+				cm->cmsg_level=SOL_SOCKET;
+				cm->cmsg_type=SCM_RIGHTS;
+				cm->cmsg_len=CMSG_LEN(sizeof(int)*fds.size());
+				memcpy(CMSG_DATA(cm),fds.data(),sizeof(int)*fds.size());
+			}
+			return 1!=sendmsg(sock,&msg,MSG_NOSIGNAL);
+		}
+		static const size_t max_handover=253; // SCM_MAX_FD
+#endif
+#ifndef _MSC_VER
+		// kept open so that a descriptor can be freed to shed connections when out of them
+		int reserve_fd=-1;
+
+		// outgoing connections waiting for a lookup or for the connect to finish
+		struct pending_connect {
+			uint64_t id;
+			std::string host;
+			int port;
+			uint64_t deadline;      // 0 without a timeout
+			int sock=-1;
+			bool resolving=false;
+			bool watched=false;     // registered for writability
+			bool ready=false;       // the connect finished, check the result
+			std::vector<resolver::address> addrs;
+			size_t next_addr=0;     // addresses are tried in order
+			std::function<void(connection*)> spawn;
+			std::function<void(const char *err)> on_fail;
+		};
+		std::vector<std::unique_ptr<pending_connect>> connecting;
+		uint64_t connect_seq=0;
+		// started on the first connect to a host name
+		std::unique_ptr<resolver> dns;
+		std::vector<resolver::result> dns_results;
+		std::set<std::string> dns_inflight;
+		struct dns_entry {
+			std::vector<resolver::address> addrs;
+			uint64_t expires;
+		};
+		std::map<std::string,dns_entry> dns_cache;
+		uint64_t dns_ttl=60000;
+		uint64_t dns_negative_ttl=5000;
+#endif
 	public:
 		class connection {
 			friend tcp;
 			int sock;
 			//std::shared_ptr<connection> conn;
 			bool want_input;
+			// the sink took nothing from the input and waits for more of it
+			bool input_stalled=false;
+			// a producer had nothing to give, output waits for send() or wake()
+			bool output_stalled=false;
 			buffer input;
 			buffer output;
+			// the owning tcp object and our slot in its connection list
+			tcp *owner;
+			size_t index;
+			// timeouts in milliseconds, deadlines are checked lazily when the
+			// timer node fires so activity only has to update a timestamp.
+			int idle_timeout=0;
+			int header_timeout=0;
+			int write_timeout=0;
+			uint64_t last_activity=0;   // last input or output
+			uint64_t last_write=0;      // last output progress or when output got stuck
+			uint64_t header_deadline=0;
+			bool write_blocked=false;   // output is waiting for the peer
+			net11::timer_wheel::node timer;
+			// bytes of queued data producers, see send()
+			size_t queued_bytes=0;
+			size_t high_water=1024*1024;
+			size_t low_water=256*1024;
+			bool above_high=false; // on_writable is due once below the low mark
+			bool doomed=false;     // closed by the output budget on the next visit
+			int pipeline_depth=16; // see listen_options
+#ifdef NET11_ACTIVE_LIST
+			// set while the connection is queued for a visit on the next poll
+			bool active=false;
+			size_t active_index=0; // the slot in tcp::active
+#endif
+#ifdef NET11_EPOLL
+			// edge triggered readiness, cleared when a call would block.
+			bool readable=false;
+			bool writable=false;
+#endif
+#ifdef NET11_IO_URING
+			bool recv_armed=false;   // a multishot receive is outstanding
+			bool recv_cancel=false;  // and we've asked for it to be cancelled
+			bool send_pending=false; // the output buffer is owned by a send
+			bool peer_closed=false;
+			bool closing=false;      // closed but waiting for operations to complete
+			int inflight=0;          // submitted operations referencing this connection
+			// received provided buffers that haven't fit in the input buffer yet
+			struct chunk {
+				unsigned short bid;
+				int off;
+				int len;
+			};
+			std::vector<chunk> chunks;
+			// the gathered output of the pending send
+			struct msghdr send_msg;
+			struct iovec send_iov[max_iov];
+			int send_iovc=0;
+#endif
 #ifdef NET11_OVERLAPPED
 			bool ol_input_pending = false;
 			bool ol_output_pending = false;
@@ -75,26 +747,560 @@ namespace net11 {
 			WSABUF wsa_output;
 			WSAOVERLAPPED overlapped_output;
 #endif
-			connection(int insize, int outsize) :input(insize), output(outsize) {}
+			friend class net11::pool<connection>;
+			// buffers take memory from the pools of the owning tcp only while in use
+			connection(buffer_pool &inpool, buffer_pool &outpool) :input(inpool), output(outpool) {
+				timer.data=this;
+			}
+			// called by the pool when a closed connection is handed out again
+			void reuse(buffer_pool &inpool, buffer_pool &outpool) {
+				// the buffers were detached at close, take later blocks from the given pools
+				input.rebind(inpool);
+				output.rebind(outpool);
+				input_stalled=false;
+				output_stalled=false;
+				idle_timeout=0;
+				header_timeout=0;
+				write_timeout=0;
+				header_deadline=0;
+				write_blocked=false;
+				high_water=1024*1024;
+				low_water=256*1024;
+				above_high=false;
+				doomed=false;
+				pipeline_depth=16;
+#ifdef NET11_ACTIVE_LIST
+				active=false;
+#endif
+#ifdef NET11_EPOLL
+				readable=false;
+				writable=false;
+#endif
+#ifdef NET11_IO_URING
+				recv_armed=false;
+				recv_cancel=false;
+				send_pending=false;
+				peer_closed=false;
+				closing=false;
+				inflight=0;
+				chunks.clear();
+				send_iovc=0;
+#endif
+			}
+			// drops the protocol state when the connection is closed
+			void release() {
+				current_sink.reset();
+				terminate=nullptr;
+				producers.clear();
+				unqueue(queued_bytes);
+				on_writable=nullptr;
+				on_drain=nullptr;
+				ctx.reset();
+				buffered_output=false;
+			}
+			// data producer bytes left the queue
+			void unqueue(size_t amount) {
+				if (amount>queued_bytes)
+					amount=queued_bytes;
+				queued_bytes-=amount;
+				output_limits().queued.fetch_sub(amount,std::memory_order_relaxed);
+			}
 		//public:
 			~connection() {
 				NET11_TCP_LOG("Socket %x killed\n", sock);
 			}
-			struct deleter {
-				void operator()(connection* p) {
-					delete p;
-				}
-			};
 		public:
 			std::shared_ptr<sink> current_sink;
+			// called when the connection is closed
 			std::function<void()> terminate;
-			std::vector<std::function<bool(buffer&)> > producers;
+			// output waiting to be sent, queue with send() so that data is
+			// counted against the water marks and the output budget.
+			net11::ring_queue<producer> producers;
 			std::shared_ptr<void> ctx;
+			// called when the queue has drained below the low water mark after
+			// a send() reported send_full.
+			std::function<void()> on_writable;
+			// called when the tcp object starts draining, protocols use it to
+			// wind down (finish the current message, send a goodbye). Without
+			// one the connection is finished at once.
+			std::function<void()> on_drain;
+			// set by protocols that must see all output bytes (for example to
+			// encrypt them), every producer is then copied through the output buffer.
+			bool buffered_output=false;
+
+			// call after pushing producers from outside of the connections own
+			// sink so that the event loop knows that there is output to send.
+			void wake() {
+				output_stalled=false;
+#ifdef NET11_ACTIVE_LIST
+				owner->activate(this);
+#endif
+			}
+			// stops reading, the connection is closed once its output is sent
+			void finish() {
+				want_input=false;
+				wake();
+			}
+			// queues a producer and wakes the loop, see send_result
+			send_result send(producer p) {
+				size_t sz=p.is_data()?p.size():0;
+				if (doomed)
+					return send_closed;
+				if (sz && !owner->admit_output(*this,sz))
+					return doomed?send_closed:send_dropped;
+				producers.push_back(std::move(p));
+				queued_bytes+=sz;
+				output_limits().queued.fetch_add(sz,std::memory_order_relaxed);
+				wake();
+				if (high_water && queued_bytes>=high_water) {
+					if (!above_high)
+						owner->out_stats.full++;
+					above_high=true;
+					return send_full;
+				}
+				return send_ok;
+			}
+			// bytes of data producers waiting to be sent
+			size_t queued() {
+				return queued_bytes;
+			}
+			// applies socket options, for example to outgoing connections
+			void set_socket_options(const socket_options &o) {
+				apply_socket_options(sock,o,true);
+			}
+			// 0 as the high water mark never reports send_full
+			void set_water_marks(size_t high,size_t low) {
+				high_water=high;
+				low_water=low<high?low:high;
+			}
+			// messages read ahead of queued output, see listen_options
+			void set_pipeline_depth(int depth) {
+				pipeline_depth=depth;
+			}
+			// sets the timeouts (in milliseconds, 0 to disable) that the listener
+			// options otherwise decide, see tcp::listen_options.
+			void set_timeouts(int idle,int header,int write) {
+				idle_timeout=idle;
+				header_timeout=header;
+				write_timeout=write;
+				owner->update_timer(*this);
+			}
+			// protocols start the header timer when a request begins to arrive
+			// and stop it once its head is complete, a running timer is kept.
+			void start_header_timer() {
+				if (!header_timeout || header_deadline)
+					return;
+				header_deadline=owner->now_ms+header_timeout;
+				owner->update_timer(*this);
+			}
+			void stop_header_timer() {
+				header_deadline=0;
+			}
 		};
 	private:
-		std::vector<std::unique_ptr<connection,connection::deleter>> conns;
+		std::vector<connection*> conns;
+		// buffer memory shared by the connections, declared first so that it
+		// outlives the connection objects
+		net11::buffer_pool input_blocks;
+		net11::buffer_pool output_blocks;
+#ifdef NET11_MIRRORED_BUFFERS
+		static const bool mirror_buffers=true;
+#else
+		static const bool mirror_buffers=false;
+#endif
+		// closed connections are recycled
+		net11::pool<connection> conn_pool;
 		int input_buffer_size;
 		int output_buffer_size;
+		// the time of the current loop turn, activity is stamped with it
+		uint64_t now_ms;
+		// one node per connection with timeouts, see update_timer
+		net11::timer_wheel conn_timers;
+		timeout_counters to_stats;
+		// the scheduler driven by poll(sched), its clock follows now_ms
+		net11::scheduler *turn_sched=nullptr;
+		output_counters out_stats;
+
+		// shared by every loop of the process
+		struct output_budget_state {
+			std::atomic<size_t> queued;
+			std::atomic<size_t> budget;
+			std::atomic<int> policy;
+		};
+		static output_budget_state& output_limits() {
+			static output_budget_state state{{0},{0},{budget_drop}};
+			return state;
+		}
+		// checks the output budget before amount more bytes are queued on c,
+		// returns false if the data should not be queued.
+		bool admit_output(connection &c,size_t amount) {
+			output_budget_state &lim=output_limits();
+			size_t budget=lim.budget.load(std::memory_order_relaxed);
+			if (!budget || lim.queued.load(std::memory_order_relaxed)+amount<=budget)
+				return true;
+			if (lim.policy.load(std::memory_order_relaxed)==budget_drop) {
+				// connections that keep up still get their output
+				if (c.queued_bytes<=c.low_water)
+					return true;
+				out_stats.dropped++;
+				return false;
+			}
+			// close the connections of this loop with the most queued output
+			// until the new data fits, their memory is freed on the next visit.
+			size_t freed=0;
+			for (auto o:conns) {
+				if (o->doomed)
+					freed+=o->queued_bytes;
+			}
+			while (lim.queued.load(std::memory_order_relaxed)+amount>budget+freed) {
+				connection *worst=nullptr;
+				for (auto o:conns) {
+					if (!o->doomed && o->queued_bytes && (!worst || o->queued_bytes>worst->queued_bytes))
+						worst=o;
+				}
+				if (!worst)
+					break;
+				worst->doomed=true;
+				out_stats.closed++;
+				freed+=worst->queued_bytes;
+#ifdef NET11_ACTIVE_LIST
+				activate(worst);
+#endif
+				if (worst==&c)
+					return false;
+			}
+			return true;
+		}
+		// tells the protocol once a backed up queue has drained
+		static void check_writable(connection &c) {
+			if (c.above_high && c.queued_bytes<=c.low_water) {
+				c.above_high=false;
+				if (c.on_writable)
+					c.on_writable();
+			}
+		}
+
+		// reads the clock once for the loop turn
+		void refresh_time() {
+			now_ms=monotonic_millis();
+			if (turn_sched)
+				turn_sched->set_now(now_ms);
+		}
+
+		// the earliest point where a timeout of the connection could run out, 0 for none
+		static uint64_t conn_deadline(connection &c) {
+			uint64_t d=0;
+			if (c.idle_timeout)
+				d=c.last_activity+c.idle_timeout;
+			if (c.header_deadline && (!d || c.header_deadline<d))
+				d=c.header_deadline;
+			if (c.write_timeout && c.write_blocked && (!d || c.last_write+c.write_timeout<d))
+				d=c.last_write+c.write_timeout;
+			return d;
+		}
+		// activity only moves deadlines forward and is picked up when the node
+		// fires, so the wheel only has to change when a deadline gets earlier.
+		void update_timer(connection &c) {
+			uint64_t d=conn_deadline(c);
+			if (d && (!c.timer.scheduled() || d<c.timer.deadline))
+				conn_timers.schedule(c.timer,d);
+		}
+		// closes connections whose timeouts ran out
+		void expire_conns() {
+			conn_timers.advance(now_ms,[this](net11::timer_wheel::node &n) {
+				connection *c=(connection*)n.data;
+				uint64_t *counter=nullptr;
+				if (c->header_deadline && now_ms>=c->header_deadline)
+					counter=&to_stats.header;
+				else if (c->write_timeout && c->write_blocked && now_ms>=c->last_write+c->write_timeout)
+					counter=&to_stats.write;
+				else if (c->idle_timeout && now_ms>=c->last_activity+c->idle_timeout)
+					counter=&to_stats.idle;
+				if (counter) {
+					(*counter)++;
+					NET11_TCP_LOG("Timeout on conn %x\n",c->sock);
+					close_conn(c);
+				} else {
+					update_timer(*c);
+				}
+			});
+		}
+		// marks output as stuck, the write timeout counts from the first time
+		void write_stuck(connection &c,uint64_t now) {
+			if (!c.write_blocked) {
+				c.last_write=now;
+				c.write_blocked=true;
+				if (c.write_timeout)
+					update_timer(c);
+			}
+		}
+		// limits a poll timeout so that the wheel is advanced in time
+		int timer_timeout(int timeout) {
+			// events scheduled during this turn (eg by an accept callback) also limit the wait
+			if (turn_sched && timeout!=0) {
+				int t=turn_sched->next_timeout();
+				if (t>=0 && (timeout<0 || t<timeout))
+					timeout=t;
+			}
+			if (!conn_timers.size() || timeout==0)
+				return timeout;
+			int t=conn_timers.next_timeout(monotonic_millis());
+			return (timeout<0 || t<timeout)?t:timeout;
+		}
+#ifdef NET11_ACTIVE_LIST
+		// connections that have events or pending work, visited by the next poll
+		std::vector<connection*> active;
+		std::vector<connection*> visiting;
+
+		void activate(connection *c) {
+			if (c->active)
+				return;
+#ifdef NET11_IO_URING
+			if (c->closing)
+				return;
+#endif
+			c->active=true;
+			c->active_index=active.size();
+			active.push_back(c);
+		}
+		// takes a connection off the next visit, the last one is swapped into its slot
+		void deactivate(connection *c) {
+			size_t idx=c->active_index;
+			c->active=false;
+			// not in active while the current turn visits it
+			if (idx>=active.size() || active[idx]!=c)
+				return;
+			if (idx!=active.size()-1) {
+				active[idx]=active.back();
+				active[idx]->active_index=idx;
+			}
+			active.pop_back();
+		}
+#endif
+#ifdef NET11_EPOLL
+		int epfd;
+		// listeners that stopped on their budget and are continued next turn
+		std::vector<listener*> backlogged;
+
+		// sockets are registered once for both directions, event data is the
+		// connection pointer or the listener pointer tagged with the low bit.
+		bool epoll_add(int sock,uint64_t tag) {
+			struct epoll_event ev;
+			memset(&ev,0,sizeof(ev));
+			ev.events=EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+			ev.data.u64=tag;
+			return 0==epoll_ctl(epfd,EPOLL_CTL_ADD,sock,&ev);
+		}
+
+		// decides if a connection can make progress without a new readiness event
+		static bool has_work(connection &c) {
+			if (c.writable && has_output(c))
+				return true;
+			if (c.want_input) {
+				if (parseable(c) && pipeline_room(c,0))
+					return true;
+				if (c.readable && c.input.total_avail())
+					return true;
+			}
+			return false;
+		}
+#endif
+#ifdef NET11_IO_URING
+		uring ring;
+		// closed connections kept alive until their submitted operations complete
+		std::vector<connection*> zombies;
+		// connections whose receive stopped because the buffer ring ran dry
+		std::vector<connection*> starved;
+
+		// completion user data is an object pointer tagged with the operation
+		enum optag {
+			op_recv=0,
+			op_send=1,
+			op_accept=2,
+			op_cancel=3,
+			op_wake=4,
+			op_connect=5  // pending connects are tagged by id instead of pointer
+		};
+		char wake_buf[64];
+		void arm_wake() {
+			struct io_uring_sqe *sqe=ring.get_sqe();
+			sqe->opcode=IORING_OP_READ;
+			sqe->fd=wake_pipe[0];
+			sqe->addr=(uint64_t)(uintptr_t)wake_buf;
+			sqe->len=sizeof(wake_buf);
+			sqe->user_data=make_ud(nullptr,op_wake);
+		}
+		static uint64_t make_ud(void *p,optag tag) {
+			return ((uint64_t)(uintptr_t)p)|tag;
+		}
+		// a single connection never holds more than this many received buffers
+		static const size_t max_chunks=4;
+
+		void arm_accept(listener &l) {
+			struct io_uring_sqe *sqe=ring.get_sqe();
+			sqe->opcode=IORING_OP_ACCEPT;
+			sqe->fd=l.sock;
+			sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+			sqe->accept_flags=SOCK_NONBLOCK|SOCK_CLOEXEC;
+			sqe->user_data=make_ud(&l,op_accept);
+		}
+		void arm_recv(connection &c) {
+			struct io_uring_sqe *sqe=ring.get_sqe();
+			sqe->opcode=IORING_OP_RECV;
+			sqe->fd=c.sock;
+			sqe->ioprio=IORING_RECV_MULTISHOT;
+			sqe->flags=IOSQE_BUFFER_SELECT;
+			sqe->buf_group=uring::buffer_group;
+			sqe->user_data=make_ud(&c,op_recv);
+			c.recv_armed=true;
+			c.inflight++;
+		}
+		void cancel_recv(connection &c) {
+			struct io_uring_sqe *sqe=ring.get_sqe();
+			sqe->opcode=IORING_OP_ASYNC_CANCEL;
+			sqe->fd=-1;
+			sqe->addr=make_ud(&c,op_recv);
+			sqe->user_data=make_ud(&c,op_cancel);
+			c.recv_cancel=true;
+			c.inflight++;
+		}
+		void arm_send(connection &c,bool more) {
+			struct io_uring_sqe *sqe=ring.get_sqe();
+			memset(&c.send_msg,0,sizeof(c.send_msg));
+			c.send_msg.msg_iov=c.send_iov;
+			c.send_msg.msg_iovlen=c.send_iovc;
+			sqe->opcode=IORING_OP_SENDMSG;
+			sqe->fd=c.sock;
+			sqe->addr=(uint64_t)(uintptr_t)&c.send_msg;
+			sqe->len=1;
+			sqe->msg_flags=MSG_NOSIGNAL|(more?NET11_MSG_MORE:0);
+			sqe->user_data=make_ud(&c,op_send);
+			c.send_pending=true;
+			c.inflight++;
+			// the kernel holds the send until the peer makes room
+			write_stuck(c,now_ms);
+		}
+
+		void complete(uint64_t ud,int res,unsigned flags) {
+			optag tag=(optag)(ud&7);
+			if (tag==op_wake) {
+				arm_wake();
+				return;
+			}
+			if (tag==op_connect) {
+				pending_connect *p=find_connect(ud>>3);
+				if (p && p->watched)
+					p->ready=true;
+				return;
+			}
+			if (tag==op_accept) {
+				listener *l=(listener*)(uintptr_t)(ud^tag);
+				if (res>=0) {
+					acc_stats.accepted++;
+					connection *c=listener_conn(*l,res);
+					l->spawn(c);
+					// accepted while the cancel of a drain was on its way
+					if (l->closing)
+						drain_conn(*c);
+				} else if (res==-EMFILE || res==-ENFILE) {
+					shed_conn(*l);
+				} else if (res!=-ECANCELED) {
+					acc_stats.errors++;
+				}
+				if (!(flags&IORING_CQE_F_MORE)) {
+					if (!l->closing) {
+						arm_accept(*l);
+					} else {
+						for (size_t i=0;i<retired.size();i++) {
+							if (retired[i].get()==l) {
+								retired.erase(retired.begin()+i);
+								break;
+							}
+						}
+					}
+				}
+				return;
+			}
+			// cancels of listener accepts need no further handling
+			if (tag==op_cancel && !(ud^tag))
+				return;
+			connection *c=(connection*)(uintptr_t)(ud^tag);
+			if (tag==op_recv) {
+				if (flags&IORING_CQE_F_BUFFER) {
+					unsigned short bid=flags>>IORING_CQE_BUFFER_SHIFT;
+					ring.took_buffer();
+					if (res>0 && !c->closing) {
+						c->chunks.push_back(connection::chunk{bid,0,res});
+						c->last_activity=now_ms;
+						traffic.bytes_in.add(res);
+					}
+					else
+						ring.return_buffer(bid);
+				}
+				if (res==0) {
+					c->peer_closed=true;
+				} else if (res==-ENOBUFS) {
+					if (!c->closing)
+						starved.push_back(c);
+				} else if (res<0 && res!=-ECANCELED) {
+					c->peer_closed=true;
+				}
+				if (!(flags&IORING_CQE_F_MORE)) {
+					c->recv_armed=false;
+					c->recv_cancel=false;
+					c->inflight--;
+				}
+			} else if (tag==op_send) {
+				c->send_pending=false;
+				c->inflight--;
+				if (res>0) {
+					consume_output(*c,res);
+					traffic.bytes_out.add(res);
+					c->last_activity=c->last_write=now_ms;
+					c->write_blocked=false;
+				} else {
+					c->peer_closed=true;
+				}
+			} else {
+				c->inflight--;
+			}
+			if (c->closing) {
+				if (!c->inflight) {
+					closesocket(c->sock);
+					unlink_conn(zombies,c);
+					recycle_conn(c);
+				}
+			} else {
+				activate(c);
+			}
+		}
+
+		// pulls received buffers into the connection input and gives them back to the ring
+		void fill_input(connection &c) {
+			while (c.chunks.size() && c.input.total_avail()) {
+				auto &ch=c.chunks.front();
+				int avail=c.input.compact();
+				int amount=ch.len<avail?ch.len:avail;
+				std::memcpy(c.input.to_produce(),ring.buffer_data(ch.bid)+ch.off,amount);
+				c.input.produced(amount);
+				c.input_stalled=false;
+				ch.off+=amount;
+				ch.len-=amount;
+				if (ch.len==0) {
+					ring.return_buffer(ch.bid);
+					c.chunks.erase(c.chunks.begin());
+				}
+			}
+		}
+
+		static bool has_work(connection &c) {
+			if (!c.send_pending && has_output(c))
+				return true;
+			if (c.want_input && pipeline_room(c,0) && (parseable(c) || c.chunks.size()))
+				return true;
+			return false;
+		}
+#endif
 
 		static void set_non_blocking_socket(int socket) {
 #ifdef _MSC_VER
@@ -115,6 +1321,170 @@ namespace net11 {
 #endif
 		}
 
+		// scatter/gather output, the output buffer is sent first followed by the
+		// data producers at the front of the queue without copying them.
+#ifdef _MSC_VER
+		typedef WSABUF iovec_t;
+		static void set_iov(iovec_t &v,const char *p,size_t len) {
+			v.buf=(CHAR*)p;
+			v.len=(ULONG)len;
+		}
+		static int send_iov(int sock,iovec_t *iov,int iovc,bool more) {
+			DWORD sent=0;
+			if (WSASend(sock,iov,iovc,&sent,0,nullptr,nullptr))
+				return -1;
+			return (int)sent;
+		}
+#else
+		typedef struct iovec iovec_t;
+		static void set_iov(iovec_t &v,const char *p,size_t len) {
+			v.iov_base=(void*)p;
+			v.iov_len=len;
+		}
+		static int send_iov(int sock,iovec_t *iov,int iovc,bool more) {
+			struct msghdr msg;
+			memset(&msg,0,sizeof(msg));
+			msg.msg_iov=iov;
+			msg.msg_iovlen=iovc;
+			return (int)sendmsg(sock,&msg,MSG_NOSIGNAL|(more?NET11_MSG_MORE:0));
+		}
+#endif
+		// can the producer be sent as is instead of being copied to the output buffer
+		static bool is_direct(connection &c,producer &p) {
+			if (c.buffered_output)
+				return false;
+#ifdef NET11_SENDFILE
+			if (p.is_file())
+				return true;
+#endif
+			return p.is_data();
+		}
+
+		// collects pending output into iovecs, returns the count and total size.
+		// more is set when output that is sent right after this batch follows
+		// (more data or a file), the kernel then holds back a partial segment
+		// instead of pushing the end of a response header on its own.
+		static int gather_output(connection &c,iovec_t *iov,size_t &total,bool &more) {
+			int iovc=0;
+			total=0;
+			more=false;
+			if (c.output.usage()) {
+				set_iov(iov[iovc++],c.output.to_consume(),c.output.usage());
+				total+=c.output.usage();
+			}
+			size_t i=0;
+			for (;i<c.producers.size() && iovc<max_iov;i++) {
+				auto &p=c.producers[i];
+				if (!p.is_data() || c.buffered_output)
+					break;
+				if (!p.size())
+					continue;
+				set_iov(iov[iovc++],p.data(),p.size());
+				total+=p.size();
+			}
+			if (iovc && i<c.producers.size())
+				more=is_direct(c,c.producers[i]);
+			return iovc;
+		}
+		// removes sent bytes from the output buffer and then the data producers
+		static void consume_output(connection &c,size_t amount) {
+			size_t fromout=amount<(size_t)c.output.usage()?amount:(size_t)c.output.usage();
+			c.output.consumed((int)fromout);
+			amount-=fromout;
+			while (c.producers.size() && c.producers.front().is_data()) {
+				auto &p=c.producers.front();
+				size_t fromp=amount<p.size()?amount:p.size();
+				p.consumed(fromp);
+				c.unqueue(fromp);
+				amount-=fromp;
+				if (p.size())
+					break;
+				c.producers.pop_front();
+			}
+		}
+		// runs the sink over the input. A sink may leave an incomplete message in
+		// the buffer, it's then only called again once more input has arrived
+		// (a sink must take something when the buffer is full).
+		static void drain_input(connection &c) {
+			int before=c.input.usage();
+			sink *s=c.current_sink.get();
+			c.want_input = c.current_sink->drain(c.input);
+			c.want_input &= bool(c.current_sink);
+			c.input_stalled = c.input.usage()==before && c.current_sink.get()==s;
+		}
+		// input that the sink can make progress on right away
+		static bool parseable(connection &c) {
+			return c.input.usage() && !c.input_stalled;
+		}
+		// The sink isn't run ahead of slow producers, so that a client can't
+		// queue up work faster than the output drains. Pipelined messages are
+		// still read up to the pipeline depth per turn (ahead counts the sink
+		// runs with output queued) while the peer keeps taking the output.
+		static bool pipeline_room(connection &c,int ahead) {
+			if (c.producers.size()<=1)
+				return true;
+			return ahead<c.pipeline_depth && !c.above_high && !c.write_blocked;
+		}
+		// runs producers into the output buffer until it's full or one that can be
+		// sent directly is next, returns false if a producer had nothing to give.
+		static bool fill_output(connection &c) {
+			c.output.compact();
+			while (c.output.total_avail() && c.producers.size() && !is_direct(c,c.producers.front())) {
+				int preuse = c.output.total_avail();
+				size_t before = c.producers.front().size();
+				bool more = c.producers.front()(c.output);
+				if (c.producers.front().is_data())
+					c.unqueue(before - c.producers.front().size());
+				if (!more) {
+					// producer finished, remove it.
+					c.producers.pop_front();
+				} else if (preuse == c.output.total_avail()) {
+					// no data was generated, don't come back until there's news
+					c.output_stalled = true;
+					return false;
+				}
+			}
+			c.output_stalled = false;
+			return true;
+		}
+		// output that can be sent or produced without waiting for a producer
+		static bool has_output(connection &c) {
+			return c.output.usage() || (c.producers.size() && !c.output_stalled);
+		}
+
+#ifdef NET11_SENDFILE
+		// sends a chunk of a file producer, returns -1 on errors, 0 when the
+		// socket is full and 1 if the whole chunk was taken.
+		int send_file(connection &c,producer &p) {
+			static const size_t chunk=1024*1024;
+			size_t amount=p.size()<chunk?p.size():chunk;
+			off_t off=(off_t)p.file_offset();
+			ssize_t rc=amount?sendfile(c.sock,p.file_fd(),&off,amount):0;
+			if (rc<0) {
+				if (!was_block())
+					return -1;
+#ifdef NET11_EPOLL
+				c.writable=false;
+#endif
+				write_stuck(c,now_ms);
+				return 0;
+			}
+			if (rc==0 && amount)
+				return -1; // the file shrunk, we can't deliver the promised length
+			p.consumed(rc);
+			traffic.bytes_out.add(rc);
+			c.last_activity=c.last_write=now_ms;
+			if (!p.size())
+				c.producers.pop_front();
+			if ((size_t)rc<amount) {
+				write_stuck(c,now_ms);
+				return 0;
+			}
+			c.write_blocked=false;
+			return 1;
+		}
+#endif
+
 #ifdef NET11_OVERLAPPED
 		static void CALLBACK completion_input(DWORD err, DWORD count, WSAOVERLAPPED *ol, DWORD flags) {
 			tcpconn *c = (tcpconn*)ol->hEvent;
@@ -218,7 +1588,7 @@ namespace net11 {
 					int preuse = c.output.total_avail();
 					if (!c.conn->producers.front()(c.output)) {
 						// producer finished, remove it.
-						c.conn->producers.erase(c.conn->producers.begin());
+						c.conn->producers.pop_front();
 					} else if (preuse == c.output.total_avail()) {
 						// no data was generated.
 						break;
@@ -255,96 +1625,722 @@ namespace net11 {
 					}
 				} else abort();
 			}
-			return c.want_input || c.output.usage() || c.conn->producers.size() || c.ol_output_pending || c.ol_input_pending;
+			return c.want_input || c.output.usage() || c.conn->producers.size() || c.ol_output_pending || c.ol_input_pending;
+		}
+
+#elif defined(NET11_IO_URING)
+		bool work_conn(connection &c) {
+			if (c.peer_closed || c.doomed)
+				return false;
+			int ahead=0;
+			while (c.want_input) {
+				fill_input(c);
+				// same rule as the readiness loop, don't parse ahead of slow producers.
+				if (parseable(c) && pipeline_room(c,ahead)) {
+					ahead+=c.producers.size()>1;
+					drain_input(c);
+					continue;
+				}
+				break;
+			}
+			// keep one multishot receive running as long as we're not backed up.
+			if (c.want_input) {
+				if (c.chunks.size()<max_chunks) {
+					if (!c.recv_armed && ring.buffers_free())
+						arm_recv(c);
+				} else if (c.recv_armed && !c.recv_cancel) {
+					cancel_recv(c);
+				}
+			}
+			// pending output belongs to the kernel until the send completes
+			if (!c.send_pending) {
+				if (c.producers.size() && !c.producers.front().is_data())
+					fill_output(c);
+				size_t total;
+				bool more;
+				c.send_iovc=gather_output(c,c.send_iov,total,more);
+				if (c.send_iovc)
+					arm_send(c,more);
+			}
+			check_writable(c);
+			// idle connections give their buffer memory back, a pending send
+			// only references the output buffer when it isn't empty.
+			c.input.detach();
+			c.output.detach();
+			return c.want_input || c.output.usage() || c.producers.size();
+		}
+
+#else
+		bool work_conn(connection &c) {
+			if (c.doomed)
+				return false;
+			int fill_count = 0;
+			int ahead = 0;
+			while (c.want_input && fill_count<10) {
+				// process events as long as we have data and don't have multiple
+				// producers on queue to avoid denial of service scenarios where
+				// the producers are too slow to drain before the sink has read
+				// (pipelined messages are read up to the depth, see pipeline_room).
+				// Note: the sink should be called first since was_block below will break the loop on block.
+				if (parseable(c) && pipeline_room(c, ahead)) {
+					ahead += c.producers.size() > 1;
+					drain_input(c);
+					continue;
+				}
+				// try to fill up the buffer as much as possible.
+				if (c.input.total_avail()) {
+					int avail = c.input.compact();
+					int rc = recv(c.sock, c.input.to_produce(), avail, 0);
+					if (rc<0) {
+						if (was_block()) {
+							//printf("WOULD BLOCK\n");
+#ifdef NET11_EPOLL
+							c.readable = false;
+#endif
+							break;
+						} else {
+							// not a blocking error!
+							return false;
+						}
+					} else if (rc>0) {
+						c.input.produced(rc);
+						c.input_stalled=false;
+						traffic.bytes_in.add(rc);
+						c.last_activity=now_ms;
+						fill_count++;
+						continue;
+					} else {
+						// 0 on recv, closed sock;
+						return false;
+					}
+				}
+				break;
+			}
+			bool eop = false;
+			while (c.output.usage() || c.producers.size()) {
+				// let function producers fill the buffer before sending so they're
+				// coalesced, but stop for the round once one of them runs dry.
+				if (!eop && c.producers.size() && !is_direct(c, c.producers.front()) && c.output.total_avail())
+					eop = !fill_output(c);
+				iovec_t iov[max_iov];
+				size_t total = 0;
+				bool more = false;
+				int iovc = gather_output(c, iov, total, more);
+				if (!iovc) {
+#ifdef NET11_SENDFILE
+					// file contents go from the page cache to the socket without a copy
+					if (c.producers.size() && c.producers.front().is_file() && !c.buffered_output) {
+						int rc = send_file(c, c.producers.front());
+						if (rc<0)
+							return false;
+						if (rc>0)
+							continue;
+					}
+#endif
+					break;
+				}
+				int rc = send_iov(c.sock, iov, iovc, more);
+				if (rc<0) {
+					if (!was_block()) {
+						// error other than wouldblock
+						return false;
+					}
+					// the socket is full, continue once it's writable again.
+#ifdef NET11_EPOLL
+					c.writable = false;
+#endif
+					write_stuck(c, now_ms);
+					break;
+				}
+				consume_output(c, rc);
+				traffic.bytes_out.add(rc);
+				c.last_activity = c.last_write = now_ms;
+				if ((size_t)rc<total) {
+					write_stuck(c, now_ms);
+					break; // could not take all data, do more later
+				}
+				c.write_blocked = false;
+			}
+			// only count a stall while something is waiting for the peer
+			if (!c.output.usage() && (c.producers.empty() || !is_direct(c, c.producers.front())))
+				c.write_blocked = false;
+			check_writable(c);
+			// idle connections give their buffer memory back
+			c.input.detach();
+			c.output.detach();
+			return c.want_input || c.output.usage() || c.producers.size();
+		}
+#endif
+
+#ifndef _MSC_VER
+		// interrupt() writes to this pipe to wake a loop blocked in poll
+		int wake_pipe[2];
+		void drain_wake_pipe() {
+			char tmp[64];
+			while(read(wake_pipe[0],tmp,sizeof(tmp))>0) {}
+		}
+#endif
+#if !defined(NET11_ACTIVE_LIST) && !defined(_MSC_VER)
+		std::vector<struct pollfd> pollfds;
+		// portable readiness wait used by the scanning loop
+		void wait_fds(int timeout) {
+			pollfds.clear();
+			struct pollfd pfd;
+			pfd.revents=0;
+			pfd.fd=wake_pipe[0];
+			pfd.events=POLLIN;
+			pollfds.push_back(pfd);
+			for (auto &l:listeners) {
+				pfd.fd=l->sock;
+				pollfds.push_back(pfd);
+			}
+			size_t connect_base=pollfds.size();
+			for (auto &p:connecting) {
+				pfd.fd=p->sock;
+				pfd.events=POLLOUT;
+				pollfds.push_back(pfd);
+			}
+			for (auto c:conns) {
+				// input left over from an earlier recv can be parsed right away
+				if (c->want_input && parseable(*c) && pipeline_room(*c,0))
+					timeout=0;
+				pfd.fd=c->sock;
+				pfd.events=(c->want_input?POLLIN:0)|(has_output(*c)?POLLOUT:0);
+				pollfds.push_back(pfd);
+			}
+			if (0<::poll(pollfds.data(),pollfds.size(),timeout)) {
+				if (pollfds[0].revents)
+					drain_wake_pipe();
+				// negative descriptors of connects without a socket are ignored by poll
+				for (size_t i=0;i<connecting.size();i++) {
+					if (pollfds[connect_base+i].revents)
+						connecting[i]->ready=true;
+				}
+			}
+		}
+#endif
+
+		// sets the socket options that differ from the defaults, the buffer
+		// sizes are skipped for accepted sockets that inherit them.
+		static void apply_socket_options(int sock,const socket_options &o,bool buffers) {
+			int on=1;
+			if (o.no_delay)
+				setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,(const char*)&on,sizeof(on));
+			if (buffers && o.send_buffer)
+				setsockopt(sock,SOL_SOCKET,SO_SNDBUF,(const char*)&o.send_buffer,sizeof(o.send_buffer));
+			if (buffers && o.receive_buffer)
+				setsockopt(sock,SOL_SOCKET,SO_RCVBUF,(const char*)&o.receive_buffer,sizeof(o.receive_buffer));
+			if (o.keepalive_idle) {
+				setsockopt(sock,SOL_SOCKET,SO_KEEPALIVE,(const char*)&on,sizeof(on));
+#ifdef TCP_KEEPIDLE
+				setsockopt(sock,IPPROTO_TCP,TCP_KEEPIDLE,(const char*)&o.keepalive_idle,sizeof(o.keepalive_idle));
+#elif defined(TCP_KEEPALIVE)
+				setsockopt(sock,IPPROTO_TCP,TCP_KEEPALIVE,(const char*)&o.keepalive_idle,sizeof(o.keepalive_idle));
+#endif
+#ifdef TCP_KEEPINTVL
+				if (o.keepalive_interval)
+					setsockopt(sock,IPPROTO_TCP,TCP_KEEPINTVL,(const char*)&o.keepalive_interval,sizeof(o.keepalive_interval));
+#endif
+#ifdef TCP_KEEPCNT
+				if (o.keepalive_count)
+					setsockopt(sock,IPPROTO_TCP,TCP_KEEPCNT,(const char*)&o.keepalive_count,sizeof(o.keepalive_count));
+#endif
+			}
+		}
+
+		// takes ownership of a new socket and hands it to the spawn function
+		connection* add_conn(int sock) {
+			connection *c=conn_pool.create(input_blocks,output_blocks);
+			conns.push_back(c);
+			c->sock=sock;
+			c->want_input=true;
+			c->owner=this;
+			c->index=conns.size()-1;
+			c->last_activity=now_ms;
+			c->last_write=now_ms;
+#ifdef NET11_EPOLL
+			epoll_add(sock,(uint64_t)(uintptr_t)c);
+			// data might already be waiting so try both directions once.
+			c->readable=true;
+			c->writable=true;
+#endif
+#ifdef NET11_ACTIVE_LIST
+			activate(c);
+#endif
+			return c;
+		}
+
+		// a connection accepted by a listener gets the listeners timeouts
+		connection* listener_conn(listener &l,int sock) {
+			connection *c=add_conn(sock);
+			traffic.accepted.add();
+			if (l.idle_timeout || l.header_timeout || l.write_timeout)
+				c->set_timeouts(l.idle_timeout,l.header_timeout,l.write_timeout);
+			c->set_water_marks(l.high_water,l.low_water);
+			c->set_pipeline_depth(l.pipeline_depth);
+			apply_socket_options(sock,l.sockopts,false);
+			return c;
+		}
+
+		// removes a connection from a list, the last connection is swapped into its slot
+		static void unlink_conn(std::vector<connection*> &list,connection *c) {
+			size_t idx=c->index;
+			if (idx!=list.size()-1) {
+				list[idx]=list.back();
+				list[idx]->index=idx;
+			}
+			list.pop_back();
+		}
+
+		void close_conn(connection *c) {
+			traffic.closed.add();
+			if (c->terminate) {
+				auto fn=std::move(c->terminate);
+				c->terminate=nullptr;
+				fn();
+			}
+			conn_timers.cancel(c->timer);
+#ifdef NET11_ACTIVE_LIST
+			if (c->active)
+				deactivate(c);
+#endif
+			c->release();
+#ifdef NET11_IO_URING
+			auto si=std::find(starved.begin(),starved.end(),c);
+			if (si!=starved.end())
+				starved.erase(si);
+			for (auto &ch:c->chunks)
+				ring.return_buffer(ch.bid);
+			c->chunks.clear();
+			if (c->inflight) {
+				// shutting down completes the pending operations, the socket
+				// is closed and the connection deleted after the last completion.
+				shutdown(c->sock,SHUT_RDWR);
+				c->closing=true;
+				unlink_conn(conns,c);
+				c->index=zombies.size();
+				zombies.push_back(c);
+				return;
+			}
+#endif
+			closesocket(c->sock);
+			unlink_conn(conns,c);
+			recycle_conn(c);
+		}
+		// gives a closed connection and its buffer memory back to the pools, this
+		// is delayed until the kernel is done with the buffers on io_uring.
+		void recycle_conn(connection *c) {
+			c->input.clear();
+			c->input.detach();
+			c->output.clear();
+			c->output.detach();
+			conn_pool.release(c);
+		}
+
+		static void drain_conn(connection &c) {
+			if (c.on_drain) {
+				auto fn=c.on_drain;
+				fn();
+			} else {
+				c.finish();
+			}
+		}
+		// stops accepting on a listener, the socket stays open in any process
+		// that it has been handed to.
+		void close_listener(std::unique_ptr<listener> &l) {
+#ifndef _MSC_VER
+			{
+				std::lock_guard<std::mutex> guard(handovers().lock);
+				handovers().listening.erase(l->sock);
+			}
+#endif
+#ifdef NET11_EPOLL
+			// a shared socket would otherwise keep reporting to this epoll set
+			epoll_ctl(epfd,EPOLL_CTL_DEL,l->sock,nullptr);
+#endif
+			closesocket(l->sock);
+#ifdef NET11_IO_URING
+			// the multishot accept holds the socket until it's cancelled
+			struct io_uring_sqe *sqe=ring.get_sqe();
+			sqe->opcode=IORING_OP_ASYNC_CANCEL;
+			sqe->fd=-1;
+			sqe->addr=make_ud(l.get(),op_accept);
+			sqe->user_data=make_ud(nullptr,op_cancel);
+			l->closing=true;
+			retired.push_back(std::move(l));
+#endif
+		}
+		void start_drain() {
+			int timeout=drain_request.exchange(-1);
+			if (timeout<0 || draining)
+				return;
+			draining=true;
+			drain_deadline=timeout?monotonic_millis()+timeout:0;
+			for (auto &l:listeners)
+				close_listener(l);
+			listeners.clear();
+#ifdef NET11_EPOLL
+			backlogged.clear();
+#endif
+			std::vector<connection*> list(conns);
+			for (auto c:list)
+				drain_conn(*c);
+		}
+		// limits a poll timeout by the drain deadline and closes what's left after it
+		int drain_timeout(int timeout) {
+			if (!draining || !drain_deadline)
+				return timeout;
+			uint64_t now=monotonic_millis();
+			if (now>=drain_deadline) {
+				while (conns.size())
+					close_conn(conns.back());
+				return 0;
+			}
+			int left=(int)(drain_deadline-now);
+			return (timeout<0 || left<timeout)?left:timeout;
+		}
+
+		// registers a bound and listening socket
+		void add_listener(int sock,const listen_options &opts,std::function<void(connection*)> spawn) {
+			set_non_blocking_socket(sock);
+#ifndef _MSC_VER
+			fcntl(sock,F_SETFD,FD_CLOEXEC);
+			{
+				std::lock_guard<std::mutex> guard(handovers().lock);
+				handovers().listening.insert(sock);
+			}
+#endif
+			listeners.emplace_back(new listener(sock,opts.accept_budget,spawn));
+			listeners.back()->idle_timeout=opts.idle_timeout;
+			listeners.back()->header_timeout=opts.header_timeout;
+			listeners.back()->write_timeout=opts.write_timeout;
+			listeners.back()->high_water=opts.high_water;
+			listeners.back()->low_water=opts.low_water;
+			listeners.back()->pipeline_depth=opts.pipeline_depth;
+			listeners.back()->sockopts=opts.socket;
+#ifdef NET11_EPOLL
+			epoll_add(sock,((uint64_t)(uintptr_t)listeners.back().get())|1);
+#endif
+#ifdef NET11_IO_URING
+			arm_accept(*listeners.back());
+#endif
 		}
 
+		static int accept_socket(int sock) {
+#ifdef __linux__
+			return accept4(sock,nullptr,nullptr,SOCK_NONBLOCK|SOCK_CLOEXEC);
 #else
-		bool work_conn(connection &c) {
-			int fill_count = 0;
-			while (c.want_input && fill_count<10) {
-				// process events as long as we have data and don't have multiple
-				// producers on queue to avoid denial of service scenarios where
-				// the producers are too slow to drain before the sink has read.
-				// Note: the sink should be called first since was_block below will break the loop on block.
-				if (c.input.usage() && c.producers.size() <= 1) {
-					c.want_input = c.current_sink->drain(c.input);
-					c.want_input &= bool(c.current_sink);
-					continue;
+			int newsock=accept(sock,nullptr,nullptr);
+#ifndef NET11_OVERLAPPED
+			if (newsock!=-1)
+				set_non_blocking_socket(newsock);
+#endif
+			return newsock;
+#endif
+		}
+
+		// Out of descriptors the pending connection would stay queued and wake
+		// us up again, so free the reserve descriptor to accept and close it.
+		// Returns false if nothing could be shed.
+		bool shed_conn(listener &l) {
+#ifdef _MSC_VER
+			return false;
+#else
+			if (reserve_fd==-1)
+				return false;
+			close(reserve_fd);
+			int sock=accept(l.sock,nullptr,nullptr);
+			if (sock!=-1) {
+				closesocket(sock);
+				acc_stats.shed++;
+			}
+			reserve_fd=open("/dev/null",O_RDONLY|O_CLOEXEC);
+			return sock!=-1;
+#endif
+		}
+
+		void accept_conns(listener &l) {
+			for (int count=0;;) {
+				if (l.budget && count>=l.budget) {
+					acc_stats.deferred++;
+#ifdef NET11_EPOLL
+					// the edge won't trigger again for connections already waiting
+					if (!l.backlog) {
+						l.backlog=true;
+						backlogged.push_back(&l);
+					}
+#endif
+					break;
 				}
-				// try to fill up the buffer as much as possible.
-				if (c.input.total_avail()) {
-					int avail = c.input.compact();
-					int rc = recv(c.sock, c.input.to_produce(), avail, 0);
-					if (rc<0) {
-						if (was_block()) {
-							//printf("WOULD BLOCK\n");
-							break;
-						} else {
-							// not a blocking error!
-							return false;
-						}
-					} else if (rc>0) {
-						c.input.produced(rc);
-						fill_count++;
+				int newsock=accept_socket(l.sock);
+				if (newsock==-1) {
+#ifndef _MSC_VER
+					if ((errno==EMFILE || errno==ENFILE) && shed_conn(l)) {
+						count++;
 						continue;
-					} else {
-						// 0 on recv, closed sock;
-						return false;
 					}
+					if (errno==ECONNABORTED || errno==EINTR) {
+						acc_stats.errors++;
+						continue;
+					}
+					if (!was_block())
+						acc_stats.errors++;
+#endif
+					break;
 				}
-				break;
+				count++;
+				acc_stats.accepted++;
+				l.spawn(listener_conn(l,newsock));
 			}
-			bool eop = false;
-			while (c.output.usage() || c.producers.size()) {
-				if (c.output.usage()) {
-#ifdef _MSC_VER
-					const int send_flags = 0;
+		}
+
+#ifndef _MSC_VER
+		pending_connect* find_connect(uint64_t id) {
+			for (auto &p:connecting) {
+				if (p->id==id)
+					return p.get();
+			}
+			return nullptr;
+		}
+		// asks the backend to tell when a connecting socket becomes writable
+		void watch_connect(pending_connect &p) {
+#ifdef NET11_EPOLL
+			struct epoll_event ev;
+			memset(&ev,0,sizeof(ev));
+			ev.events=EPOLLOUT;
+			ev.data.u64=(p.id<<2)|2;
+			epoll_ctl(epfd,EPOLL_CTL_ADD,p.sock,&ev);
+#endif
+#ifdef NET11_IO_URING
+			struct io_uring_sqe *sqe=ring.get_sqe();
+			sqe->opcode=IORING_OP_POLL_ADD;
+			sqe->fd=p.sock;
+			sqe->poll32_events=POLLOUT;
+			sqe->user_data=(p.id<<3)|op_connect;
+#endif
+			p.watched=true;
+		}
+		void unwatch_connect(pending_connect &p) {
+			if (!p.watched)
+				return;
+#ifdef NET11_EPOLL
+			epoll_ctl(epfd,EPOLL_CTL_DEL,p.sock,nullptr);
+#endif
+#ifdef NET11_IO_URING
+			if (!p.ready) {
+				// the completion of the cancelled poll is ignored since the id is gone
+				struct io_uring_sqe *sqe=ring.get_sqe();
+				sqe->opcode=IORING_OP_ASYNC_CANCEL;
+				sqe->fd=-1;
+				sqe->addr=(p.id<<3)|op_connect;
+				sqe->user_data=op_connect;
+			}
+#endif
+			p.watched=false;
+		}
+		// starts a non-blocking connect to the next address, false when none are left
+		bool start_connect(pending_connect &p) {
+			while (p.next_addr<p.addrs.size()) {
+				resolver::address a=p.addrs[p.next_addr++];
+				if (a.addr.ss_family==AF_INET)
+					((struct sockaddr_in*)&a.addr)->sin_port=htons(p.port);
+				else if (a.addr.ss_family==AF_INET6)
+					((struct sockaddr_in6*)&a.addr)->sin6_port=htons(p.port);
+				int proto=a.addr.ss_family==AF_UNIX?0:IPPROTO_TCP;
+#ifdef __linux__
+				int sock=socket(a.addr.ss_family,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,proto);
 #else
-					const int send_flags = MSG_NOSIGNAL;
+				int sock=socket(a.addr.ss_family,SOCK_STREAM,proto);
+				if (sock!=-1)
+					set_non_blocking_socket(sock);
 #endif
-					int rc = send(c.sock, c.output.to_consume(), c.output.usage(), send_flags);
-					if (rc<0) {
-						if (!was_block()) {
-							// error other than wouldblock
-							return false;
+				if (sock==-1)
+					continue;
+				int rc=::connect(sock,(struct sockaddr*)&a.addr,a.len);
+				if (rc==0 || errno==EINPROGRESS) {
+					p.sock=sock;
+					p.ready=rc==0;
+					if (!p.ready)
+						watch_connect(p);
+					return true;
+				}
+				closesocket(sock);
+			}
+			return false;
+		}
+		// removes a pending connect and reports the outcome, err is null on success
+		void finish_connect(size_t idx,const char *err) {
+			std::unique_ptr<pending_connect> p=std::move(connecting[idx]);
+			connecting[idx]=std::move(connecting.back());
+			connecting.pop_back();
+			if (err) {
+				if (p->sock!=-1) {
+					unwatch_connect(*p);
+					closesocket(p->sock);
+				}
+				if (p->on_fail)
+					p->on_fail(err);
+			} else {
+				traffic.connected.add();
+				p->spawn(add_conn(p->sock));
+			}
+		}
+		// applies finished lookups and advances all pending connects
+		void update_connects() {
+			if (connecting.empty())
+				return;
+			uint64_t now=now_ms;
+			if (dns) {
+				dns->take(dns_results);
+				for (auto &r:dns_results) {
+					dns_inflight.erase(r.host);
+					dns_entry &e=dns_cache[r.host];
+					e.addrs=r.addrs;
+					e.expires=now+(r.addrs.size()?dns_ttl:dns_negative_ttl);
+					for (auto &p:connecting) {
+						if (p->resolving && p->host==r.host) {
+							p->resolving=false;
+							p->addrs=r.addrs;
 						}
-					} else if (rc>0) {
-						//bool brk=rc!=c.output.usage();
-						c.output.consumed(rc);
-						//c.output.erase(c.output.begin(),c.output.begin()+rc);
-						if (c.output.usage())
-							break; // could not take all data, do more later
 					}
 				}
-				if (eop)
-					break;
-				while (c.output.total_avail() && c.producers.size()) {
-					int preuse = c.output.total_avail();
-					if (!c.producers.front()(c.output)) {
-						// producer finished, remove it.
-						c.producers.erase(c.producers.begin());
-					} else if (preuse == c.output.total_avail()) {
-						// no data was generated.
-						eop = true;
-						break;
+				dns_results.clear();
+			}
+			for (size_t i=0;i<connecting.size();) {
+				pending_connect &p=*connecting[i];
+				if (p.ready) {
+					int err=0;
+					socklen_t len=sizeof(err);
+					getsockopt(p.sock,SOL_SOCKET,SO_ERROR,&err,&len);
+					unwatch_connect(p);
+					if (!err) {
+						finish_connect(i,nullptr);
+						continue;
 					}
+					// try the next address of the host
+					closesocket(p.sock);
+					p.sock=-1;
+					p.ready=false;
+				}
+				if (p.deadline && now>=p.deadline) {
+					finish_connect(i,"connect timed out");
+					continue;
+				}
+				if (!p.resolving && p.sock==-1 && !start_connect(p)) {
+					finish_connect(i,p.addrs.size()?"connect failed":"host lookup failed");
+					continue;
 				}
+				// connects that finished at once are handled right away
+				if (!p.ready)
+					i++;
+			}
+		}
+		// limits a poll timeout by the pending connect deadlines
+		int connect_timeout(int timeout) {
+			if (connecting.empty())
+				return timeout;
+			uint64_t now=monotonic_millis();
+			for (auto &p:connecting) {
+				// connects that haven't been started or have finished need a turn now
+				if ((!p->resolving && p->sock==-1) || p->ready)
+					return 0;
+				if (!p->deadline)
+					continue;
+				int left=p->deadline>now?(int)(p->deadline-now):0;
+				if (timeout<0 || left<timeout)
+					timeout=left;
+			}
+			return timeout;
+		}
+		// drops expired lookups once the cache gets large
+		void prune_dns_cache(uint64_t now) {
+			for (auto it=dns_cache.begin();it!=dns_cache.end();) {
+				if (it->second.expires<=now)
+					it=dns_cache.erase(it);
+				else
+					++it;
 			}
-			return c.want_input || c.output.usage() || c.producers.size();
 		}
 #endif
 
-
 	public:
-		tcp(int in_input_buffer_size=4096,int in_out_buffer_size=4096):input_buffer_size(in_input_buffer_size),output_buffer_size(in_out_buffer_size) {
+		tcp(int in_input_buffer_size=4096,int in_out_buffer_size=4096):input_blocks(in_input_buffer_size,1024,mirror_buffers),output_blocks(in_out_buffer_size,1024,mirror_buffers),input_buffer_size(in_input_buffer_size),output_buffer_size(in_out_buffer_size),now_ms(monotonic_millis()),conn_timers(now_ms) {
+			memset(&to_stats,0,sizeof(to_stats));
+			memset(&out_stats,0,sizeof(out_stats));
 #ifdef _MSC_VER
 			WSADATA wsa_data;
 			if (WSAStartup(MAKEWORD(1,0),&wsa_data)) {
 				throw new std::exception("WSAStartup problem");
 			}
+#endif
+			memset(&acc_stats,0,sizeof(acc_stats));
+			traffic_registry().add(&traffic);
+#ifndef _MSC_VER
+			reserve_fd=open("/dev/null",O_RDONLY|O_CLOEXEC);
+			if (pipe(wake_pipe)) {
+				throw std::runtime_error("wake pipe creation failed");
+			}
+			for (int i=0;i<2;i++) {
+				set_non_blocking_socket(wake_pipe[i]);
+				fcntl(wake_pipe[i],F_SETFD,FD_CLOEXEC);
+			}
+#endif
+#ifdef NET11_EPOLL
+			epfd=epoll_create1(EPOLL_CLOEXEC);
+			if (epfd==-1) {
+				throw std::runtime_error("epoll_create1 failed");
+			}
+			// the wake pipe is registered as a listener tag without a listener
+			epoll_add(wake_pipe[0],1);
+#endif
+#ifdef NET11_IO_URING
+			ring.setup(NET11_IO_URING_ENTRIES,NET11_IO_URING_BUFFERS,input_buffer_size);
+			arm_wake();
 #endif
 		}
+		tcp(const tcp &)=delete;
+		tcp& operator=(const tcp &)=delete;
 		~tcp() {
+			traffic_registry().remove(&traffic);
+#ifndef _MSC_VER
+			// the resolver thread must stop writing to the wake pipe before it's closed
+			dns.reset();
+			for (auto &p:connecting) {
+				if (p->sock!=-1)
+					closesocket(p->sock);
+			}
+#endif
+			for (auto c:conns) {
+				closesocket(c->sock);
+				c->release();
+				delete c;
+			}
+			for (auto &l:listeners) {
+				closesocket(l->sock);
+#ifndef _MSC_VER
+				{
+					std::lock_guard<std::mutex> guard(handovers().lock);
+					handovers().listening.erase(l->sock);
+				}
+				if (l->unix_path.size())
+					unlink(l->unix_path.c_str());
+#endif
+			}
+#ifdef NET11_EPOLL
+			close(epfd);
+#endif
+#ifndef _MSC_VER
+			close(wake_pipe[0]);
+			close(wake_pipe[1]);
+			if (reserve_fd!=-1)
+				close(reserve_fd);
+#endif
+#ifdef NET11_IO_URING
+			for (auto c:zombies) {
+				closesocket(c->sock);
+				delete c;
+			}
+#endif
 #ifdef _MSC_VER
 			//if (WSACleanup()) {
 				//std::cerr<<"WSACleanup shutdown error"<<std::endl;
@@ -352,68 +2348,377 @@ namespace net11 {
 			//}
 #endif
 		}
-		bool poll() {
+		// does one round of network work, waiting up to timeout milliseconds
+		// for socket events first (0 never blocks and -1 waits indefinitely).
+		// Returns false when there is nothing left to serve.
+		bool poll(int timeout=0) {
+#ifndef _MSC_VER
+			// this process is serving, tell the one that handed over its listeners
+			if (handovers().ready_sock.load(std::memory_order_relaxed)!=-1) {
+				int fd=handovers().ready_sock.exchange(-1);
+				if (fd!=-1)
+					close(fd);
+			}
+#endif
+			if (drain_request.load(std::memory_order_relaxed)>=0)
+				start_drain();
+			timeout=drain_timeout(timeout);
+#ifdef _MSC_VER
 			if(listeners.size()==0 && conns.size()==0)
 				return false;
-			// first see if we have any new connections
-			for(auto l:listeners) {
-				while(true) {
-					struct sockaddr_in addr;
-#ifdef _MSC_VER
-					int addrsize=sizeof(addr);
 #else
-					socklen_t addrsize=sizeof(addr);
+#ifdef NET11_IO_URING
+			// an accept that a drain cancelled can still complete with a connection
+			if(listeners.size()==0 && conns.size()==0 && connecting.size()==0 && retired.size()==0)
+				return false;
+#else
+			if(listeners.size()==0 && conns.size()==0 && connecting.size()==0)
+				return false;
 #endif
-					int newsock=accept(l.first,(struct sockaddr*)&addr,&addrsize);
-					if (newsock!=-1) {
-#ifndef NET11_OVERLAPPED
-						set_non_blocking_socket(newsock);
-#endif
-						//conns.push_back(std::shared_ptr<connection>(
-						conns.emplace_back(
-							new connection(input_buffer_size,output_buffer_size)
-							//,[](auto p) { delete p; }
-						);
-						conns.back()->sock=newsock;
-						conns.back()->want_input=true;
-						
-						//conns.back()->conn=l.second()->shared_from_this();
-						//conns.back()->conn.reset(l.second());
-						l.second(conns.back().get());
-						
-						continue;
-					} else {
-						break;
-					}
+			timeout=connect_timeout(timeout);
+#endif
+#ifndef NET11_IO_URING
+			timeout=timer_timeout(timeout);
+#endif
+#ifdef NET11_ACTIVE_LIST
+			// never sleep while connections can still progress on their own
+			if (active.size())
+				timeout=0;
+#endif
+#ifdef NET11_EPOLL
+			if (backlogged.size())
+				timeout=0;
+			// collect readiness, listeners accept directly and connections are queued
+			struct epoll_event evs[256];
+			int evc=epoll_wait(epfd,evs,256,timeout);
+			refresh_time();
+			for (int i=0;i<evc;i++) {
+				uint64_t tag=evs[i].data.u64;
+				if (tag==1) {
+					drain_wake_pipe();
+					continue;
+				}
+				if (tag&2) {
+					pending_connect *p=find_connect(tag>>2);
+					if (p)
+						p->ready=true;
+					continue;
+				}
+				if (tag&1) {
+					listener *l=(listener*)(uintptr_t)(tag^1);
+					// backlogged listeners get their turn below
+					if (!l->backlog)
+						accept_conns(*l);
+					continue;
+				}
+				connection *c=(connection*)(uintptr_t)tag;
+				if (evs[i].events&(EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+					c->readable=true;
+				if (evs[i].events&(EPOLLOUT|EPOLLHUP|EPOLLERR))
+					c->writable=true;
+				activate(c);
+			}
+			// listeners that ran out of budget on the previous turn continue
+			size_t bn=backlogged.size();
+			for (size_t i=0;i<bn;i++) {
+				listener *l=backlogged[i];
+				l->backlog=false;
+				accept_conns(*l);
+			}
+			backlogged.erase(backlogged.begin(),backlogged.begin()+bn);
+			update_connects();
+			// now only visit the connections that have something to do
+			visiting.swap(active);
+			for (auto c:visiting) {
+				c->active=false;
+				if (!work_conn(*c)) {
+					NET11_TCP_LOG("Wanting to remove conn %x!\n",c->sock);
+					close_conn(c);
+				} else if (has_work(*c)) {
+					activate(c);
+				}
+			}
+			visiting.clear();
+			expire_conns();
+#elif defined(NET11_IO_URING)
+			// handle everything the kernel completed since the last turn
+			refresh_time();
+			ring.reap([this](uint64_t ud,int res,unsigned flags) {
+				complete(ud,res,flags);
+			});
+			update_connects();
+			if (starved.size() && ring.buffers_free()) {
+				for (auto c:starved)
+					activate(c);
+				starved.clear();
+			}
+			visiting.swap(active);
+			for (auto c:visiting) {
+				c->active=false;
+				if (!work_conn(*c)) {
+					NET11_TCP_LOG("Wanting to remove conn %x!\n",c->sock);
+					close_conn(c);
+				} else if (has_work(*c)) {
+					activate(c);
 				}
 			}
+			visiting.clear();
+			expire_conns();
+			// then give back buffers and submit all new operations with one syscall,
+			// the wait for the next completions happens within the same call.
+			ring.publish_buffers();
+			if (active.size() || starved.size())
+				timeout=0;
+			timeout=timer_timeout(timeout);
+			ring.submit(timeout?1:0,timeout);
+#else
+#ifdef _MSC_VER
+			if (timeout)
+				SleepEx(timeout<0||timeout>10?10:timeout,TRUE);
+			refresh_time();
+#else
+			wait_fds(timeout);
+			refresh_time();
+			update_connects();
+#endif
+			// first see if we have any new connections
+			for(auto &l:listeners) {
+				accept_conns(*l);
+			}
 			// now see if we have new data
-			// TODO: rewrite this to use kevent,etc
-			conns.erase(
-				std::remove_if(
-					conns.begin(),
-					conns.end(),
-					[this](auto & c) {
-						//printf("running conn:%p\n",&c);
-						if (!work_conn(*c)) {
-							NET11_TCP_LOG("Wanting to remove conn %x!\n",c->sock);
-							closesocket(c->sock);
-							return true;
-						} else {
-							return false;
-						}
-					}
-				),
-				conns.end()
-			);
+			for (size_t i=0;i<conns.size();) {
+				connection *c=conns[i];
+				if (!work_conn(*c)) {
+					NET11_TCP_LOG("Wanting to remove conn %x!\n",c->sock);
+					// close_conn moves the last connection into this slot
+					close_conn(c);
+				} else {
+					i++;
+				}
+			}
+			expire_conns();
+#endif
 			return true; // change this somehow?
 		}
-		bool listen(int port,std::function<void(connection*)> spawn) {
+		// one blocking loop iteration where the wait is limited by the next scheduler event
+		bool poll(net11::scheduler &sched,int max_wait=-1) {
+			int timeout=sched.next_timeout();
+			if (max_wait>=0 && (timeout<0 || timeout>max_wait))
+				timeout=max_wait;
+			turn_sched=&sched;
+			bool rv=poll(timeout);
+			turn_sched=nullptr;
+			sched.poll(now_ms);
+			return rv;
+		}
+		// serve connections and run timers until there is nothing left to serve
+		void run(net11::scheduler &sched) {
+			while(poll(sched)) {}
+		}
+		void run() {
+			while(poll(-1)) {}
+		}
+		// wakes up a poll blocked on another thread, safe to call from any thread
+		void interrupt() {
+#ifndef _MSC_VER
+			char c=0;
+			if (write(wake_pipe[1],&c,1)) {}
+#endif
+		}
+		// stops accepting and winds down the connections through their
+		// on_drain functions, the ones left after timeout milliseconds (0 for
+		// no limit) are closed. poll returns false once all are gone. Safe to
+		// call from other threads and signal handlers, the drain starts on the
+		// next turn of the loop.
+		void drain(int timeout=30000) {
+			drain_request.store(timeout<0?0:timeout);
+			interrupt();
+		}
+		bool is_draining() {
+			return draining;
+		}
+#ifndef _MSC_VER
+		// Zero downtime restarts pass the listening sockets of the process to
+		// a new one, whose listen() calls for the same ports and paths adopt
+		// them while the old process drains. Either exec the new program after
+		// share_listeners() or let it call receive_listeners() on the path
+		// that the old one serves with handover().
+
+		// makes the listening sockets inheritable and lists them in the
+		// NET11_LISTEN_FDS environment variable for programs exec'd from here.
+		static void share_listeners() {
+			std::lock_guard<std::mutex> guard(handovers().lock);
+			std::string list;
+			for (int fd:handovers().listening) {
+				fcntl(fd,F_SETFD,0);
+				if (list.size())
+					list+=",";
+				list+=std::to_string(fd);
+			}
+			setenv("NET11_LISTEN_FDS",list.c_str(),1);
+		}
+		// serves the listening sockets of the process on a unix socket path,
+		// on_taken is called once the receiving process runs its first poll
+		// (usually to drain this one).
+		bool handover(const std::string &path,std::function<void()> on_taken=nullptr) {
+			struct discard_sink : public sink {
+				bool drain(buffer &buf) {
+					buf.consumed(buf.usage());
+					return true;
+				}
+			};
+			auto discard=std::make_shared<discard_sink>();
+			if (listen(path,[on_taken,discard](connection *c) {
+				c->current_sink=discard;
+				if (send_listeners(c->sock))
+					c->finish();
+				else
+					c->terminate=on_taken; // the receiver closes the connection when ready
+			}))
+				return true;
+			// the handover socket itself isn't passed on
+			std::lock_guard<std::mutex> guard(handovers().lock);
+			handovers().listening.erase(listeners.back()->sock);
+			return false;
+		}
+		// takes the listening sockets from a process serving handover() on the
+		// path, returns true on error.
+		static bool receive_listeners(const std::string &path) {
+			resolver::address a;
+			if (!resolver::parse_unix(path,a))
+				return true;
+			int sock=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+			if (sock==-1)
+				return true;
+			if (::connect(sock,(struct sockaddr*)&a.addr,a.len)) {
+				closesocket(sock);
+				return true;
+			}
+			char count;
+			struct iovec iov;
+			iov.iov_base=&count;
+			iov.iov_len=1;
+			struct msghdr msg;
+			memset(&msg,0,sizeof(msg));
+			msg.msg_iov=&iov;
+			msg.msg_iovlen=1;
+			std::vector<char> ctrl(CMSG_SPACE(sizeof(int)*max_handover));
+			msg.msg_control=ctrl.data();
+			msg.msg_controllen=ctrl.size();
+			if (1!=recvmsg(sock,&msg,MSG_CMSG_CLOEXEC)) {
+				closesocket(sock);
+				return true;
+			}
+			handover_state &st=handovers();
+			std::lock_guard<std::mutex> guard(st.lock);
+			for (struct cmsghdr *cm=CMSG_FIRSTHDR(&msg);cm;cm=CMSG_NXTHDR(&msg,cm)) {
+				if (cm->cmsg_level!=SOL_SOCKET || cm->cmsg_type!=SCM_RIGHTS)
+					continue;
+				size_t n=(cm->cmsg_len-CMSG_LEN(0))/sizeof(int);
+				int *fds=(int*)CMSG_DATA(cm);
+				for (size_t i=0;i<n;i++)
+					st.inherited.push_back(fds[i]);
+			}
+			int old=st.ready_sock.exchange(sock);
+			if (old!=-1)
+				closesocket(old);
+			return false;
+		}
+#endif
+		accept_counters accept_stats() {
+			return acc_stats;
+		}
+		// the number of connections closed by each kind of timeout
+		timeout_counters timeout_stats() {
+			return to_stats;
+		}
+		output_counters output_stats() {
+			return out_stats;
+		}
+		// connection and byte counts of this loop
+		traffic_counters traffic_stats() {
+			traffic_counters out;
+			memset(&out,0,sizeof(out));
+			traffic.sum(out);
+			return out;
+		}
+		// the counts of every loop in the process including finished ones,
+		// safe to call from any thread.
+		static traffic_counters traffic_totals() {
+			return traffic_registry().total();
+		}
+		// caps the bytes queued in data producers by all connections of the
+		// process (0 for no limit), the policy decides who pays when it's full.
+		static void output_budget(size_t bytes,budget_policy policy=budget_drop) {
+			output_limits().policy.store(policy,std::memory_order_relaxed);
+			output_limits().budget.store(bytes,std::memory_order_relaxed);
+		}
+		// bytes currently queued in data producers by all connections
+		static size_t output_queued() {
+			return output_limits().queued.load(std::memory_order_relaxed);
+		}
+		// counters for the connection objects of this loop
+		net11::pool_stats connection_stats() {
+			return conn_pool.stats();
+		}
+		// the number of closed connections kept for reuse (default 1024)
+		void connection_pool_limit(size_t limit) {
+			conn_pool.limit(limit);
+		}
+		// counters for buffer memory, connections only hold input and output
+		// buffers while they have unread input or pending output.
+		net11::pool_stats input_buffer_stats() {
+			return input_blocks.stats();
+		}
+		net11::pool_stats output_buffer_stats() {
+			return output_blocks.stats();
+		}
+		// the number of unused buffers of each kind kept for reuse (default 1024)
+		void buffer_pool_limit(size_t limit) {
+			input_blocks.limit(limit);
+			output_blocks.limit(limit);
+		}
+		bool listen(int port,std::function<void(connection*)> spawn,const listen_options &opts=listen_options()) {
 			int sock=-1;
 			struct sockaddr_in sockaddr;
+#ifndef _MSC_VER
+			// a socket handed over by an old process keeps its pending connections
+			resolver::address bound;
+			memset(&bound,0,sizeof(bound));
+			struct sockaddr_in *bin=(struct sockaddr_in*)&bound.addr;
+			bin->sin_family=AF_INET;
+			bin->sin_port=htons(port);
+			bound.len=sizeof(*bin);
+			if (-1!=(sock=adopt_listener(bound))) {
+				add_listener(sock,opts,spawn);
+				return false;
+			}
+#endif
 			if (-1==(sock=socket(PF_INET,SOCK_STREAM,IPPROTO_TCP))) {
 				return true;
 			}
+			// accepted sockets inherit the buffer sizes
+			socket_options bufs;
+			bufs.send_buffer=opts.socket.send_buffer;
+			bufs.receive_buffer=opts.socket.receive_buffer;
+			apply_socket_options(sock,bufs,true);
+#ifndef _MSC_VER
+			// allow quick restarts while old connections linger in TIME_WAIT
+			int one=1;
+			setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+#endif
+			if (opts.reuse_port) {
+#ifdef SO_REUSEPORT
+				int on=1;
+				if (setsockopt(sock,SOL_SOCKET,SO_REUSEPORT,(const char*)&on,sizeof(on))) {
+					closesocket(sock);
+					return true;
+				}
+#else
+				closesocket(sock);
+				return true;
+#endif
+			}
 			memset(&sockaddr,0,sizeof(sockaddr));
 			sockaddr.sin_family=AF_INET;
 			sockaddr.sin_addr.s_addr=0; // default addr
@@ -426,10 +2731,45 @@ namespace net11 {
 				closesocket(sock);
 				return true;
 			}
-			set_non_blocking_socket(sock);
-			listeners.push_back(std::make_pair(sock,spawn));
+#ifdef TCP_DEFER_ACCEPT
+			if (opts.defer_accept)
+				setsockopt(sock,IPPROTO_TCP,TCP_DEFER_ACCEPT,&opts.defer_accept,sizeof(opts.defer_accept));
+#endif
+			add_listener(sock,opts,spawn);
+			return false;
+		}
+#ifndef _MSC_VER
+		// listens on a unix domain socket, paths starting with @ are in the
+		// abstract namespace, otherwise a stale socket file is replaced.
+		bool listen(const std::string &path,std::function<void(connection*)> spawn,const listen_options &opts=listen_options()) {
+			resolver::address a;
+			if (!resolver::parse_unix(path,a))
+				return true;
+			bool is_file=path[0]!='@';
+			int sock=adopt_listener(a);
+			if (sock!=-1) {
+				add_listener(sock,opts,spawn);
+				if (is_file)
+					listeners.back()->unix_path=path;
+				return false;
+			}
+			sock=socket(AF_UNIX,SOCK_STREAM,0);
+			if (sock==-1)
+				return true;
+			struct stat st;
+			if (is_file && 0==lstat(path.c_str(),&st) && S_ISSOCK(st.st_mode))
+				unlink(path.c_str());
+			if (bind(sock,(struct sockaddr*)&a.addr,a.len) || ::listen(sock,SOMAXCONN)) {
+				closesocket(sock);
+				return true;
+			}
+			add_listener(sock,opts,spawn);
+			if (is_file)
+				listeners.back()->unix_path=path;
 			return false;
 		}
+#endif
+#ifdef _MSC_VER
 		bool connect(const std::string & host,int port,const std::function<void(connection*)> spawn) {
 			struct sockaddr_in sockaddr;
 			memset(&sockaddr,0,sizeof(sockaddr));
@@ -455,17 +2795,68 @@ namespace net11 {
 				return true;
 			}
 			set_non_blocking_socket(sock);
-			//std::shared_ptr<connection> out(
-			auto* out=new connection(input_buffer_size,output_buffer_size);
-			//	[](auto p) { delete p; }
-			//);
-			out->sock=sock;
-			out->want_input=true;
-			spawn(out);
-			//out->conn.reset(spawn());
-			conns.emplace_back(out);
+			traffic.connected.add();
+			spawn(add_conn(sock));
+			return false;
+		}
+#else
+		// Starts an outgoing connection, spawn is called from the loop once it's
+		// established and on_fail (if set) with a reason when the lookup, every
+		// address or the timeout (in milliseconds, 0 for none) fails. Host names
+		// are looked up on a background thread and cached, returns true if the
+		// connect can't be started at all.
+		bool connect(const std::string & host,int port,const std::function<void(connection*)> spawn,std::function<void(const char *err)> on_fail=nullptr,int timeout=30000) {
+			if (port<=0 || port>65535)
+				return true;
+			uint64_t now=monotonic_millis();
+			std::unique_ptr<pending_connect> p(new pending_connect());
+			p->id=++connect_seq;
+			p->host=host;
+			p->port=port;
+			p->deadline=timeout>0?now+timeout:0;
+			p->spawn=spawn;
+			p->on_fail=on_fail;
+			resolver::address numeric;
+			if (resolver::parse_numeric(host,numeric)) {
+				p->addrs.push_back(numeric);
+			} else {
+				auto ci=dns_cache.find(host);
+				if (ci!=dns_cache.end() && ci->second.expires>now) {
+					p->addrs=ci->second.addrs;
+				} else {
+					p->resolving=true;
+					if (!dns)
+						dns.reset(new resolver(wake_pipe[1]));
+					if (dns_inflight.insert(host).second)
+						dns->request(host);
+					if (dns_cache.size()>1024)
+						prune_dns_cache(now);
+				}
+			}
+			connecting.push_back(std::move(p));
+			return false;
+		}
+		// connects to a unix domain socket, see listen(path,...) and connect(host,port,...)
+		bool connect(const std::string &path,const std::function<void(connection*)> spawn,std::function<void(const char *err)> on_fail=nullptr,int timeout=30000) {
+			std::unique_ptr<pending_connect> p(new pending_connect());
+			p->addrs.resize(1);
+			if (!resolver::parse_unix(path,p->addrs[0]))
+				return true;
+			p->id=++connect_seq;
+			p->host=path;
+			p->port=0;
+			p->deadline=timeout>0?monotonic_millis()+timeout:0;
+			p->spawn=spawn;
+			p->on_fail=on_fail;
+			connecting.push_back(std::move(p));
 			return false;
 		}
+		// how long (in milliseconds) successful and failed lookups are cached
+		void dns_cache_ttl(uint64_t ttl,uint64_t negative_ttl) {
+			dns_ttl=ttl;
+			dns_negative_ttl=negative_ttl;
+		}
+#endif
 
 //		class connection : public std::enable_s {
 //			connection() {
@@ -477,5 +2868,81 @@ namespace net11 {
 //		public:
 //		};
 	};
+
+	// A group of independent tcp loops, each run on its own thread with its
+	// own scheduler. Listening is done with one SO_REUSEPORT socket per loop
+	// so the kernel spreads connections and the loops share nothing, spawn and
+	// route functions are copied to every loop and must be thread safe.
+	class tcp_group {
+		struct loop {
+			tcp net;
+			net11::scheduler sched;
+			loop(int insize,int outsize):net(insize,outsize) {}
+		};
+		std::vector<std::unique_ptr<loop>> loops;
+		std::atomic<bool> stopping;
+
+		static loop*& current_loop() {
+			static thread_local loop* cur=nullptr;
+			return cur;
+		}
+		void run_loop(loop &l) {
+			current_loop()=&l;
+			while(!stopping.load(std::memory_order_relaxed) && l.net.poll(l.sched)) {}
+			current_loop()=nullptr;
+		}
+	public:
+		tcp_group(int count=std::thread::hardware_concurrency(),int in_input_buffer_size=4096,int in_out_buffer_size=4096):stopping(false) {
+			if (count<1)
+				count=1;
+			for (int i=0;i<count;i++)
+				loops.emplace_back(new loop(in_input_buffer_size,in_out_buffer_size));
+		}
+		size_t size() {
+			return loops.size();
+		}
+		tcp& operator[](size_t idx) {
+			return loops[idx]->net;
+		}
+		net11::scheduler& scheduler(size_t idx) {
+			return loops[idx]->sched;
+		}
+		// the scheduler of the loop running on the calling thread (null outside loops)
+		static net11::scheduler* local_scheduler() {
+			loop *l=current_loop();
+			return l?&l->sched:nullptr;
+		}
+		// listen on the same port from every loop, returns true on error like tcp::listen
+		bool listen(int port,std::function<void(tcp::connection*)> spawn,tcp::listen_options opts=tcp::listen_options()) {
+			opts.reuse_port=true;
+			for (auto &l:loops) {
+				if (l->net.listen(port,spawn,opts))
+					return true;
+			}
+			return false;
+		}
+		// runs all loops, the calling thread runs the first one, returns when all have finished
+		void run() {
+			std::vector<std::thread> threads;
+			for (size_t i=1;i<loops.size();i++) {
+				loop *l=loops[i].get();
+				threads.emplace_back([this,l]() { run_loop(*l); });
+			}
+			run_loop(*loops[0]);
+			for (auto &t:threads)
+				t.join();
+		}
+		// drains every loop, see tcp::drain
+		void drain(int timeout=30000) {
+			for (auto &l:loops)
+				l->net.drain(timeout);
+		}
+		// asks all loops to exit after their current iteration
+		void stop() {
+			stopping.store(true);
+			for (auto &l:loops)
+				l->net.interrupt();
+		}
+	};
 }
 
@@ -12,14 +12,40 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <type_traits>
+#include <stdexcept>
+#include <cstddef>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 
 #ifdef _MSC_VER
 #include <winsock2.h>
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// The parsers scan bytes with SSE2 or AVX2 on x86, the AVX2 kernels are
+// compiled with target attributes and picked at runtime when the cpu has
+// them. Define NET11_NO_SIMD to only use the portable kernels.
+#if !defined(NET11_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)))
+#define NET11_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define NET11_AVX2
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
 
 namespace net11 {
 	// a sink is a data receiver
@@ -32,33 +58,470 @@ namespace net11 {
 	// a utility sink that parses RFC 822 headers
 	class header_parser_sink;
 
+	// producers generate output data for connections
+	class producer;
+	// a callable wrapper that keeps small functions inside the object
+	template<class Sig,size_t N=48>
+	class small_function;
+	// a FIFO on a growable ring
+	template<class T>
+	class ring_queue;
+
 	// utility functions to create producers from a string or vector
 	template<typename T>
-	std::function<bool(buffer &)> make_data_producer(T * in_data);
+	producer make_data_producer(std::shared_ptr<T> data);
+	template<typename T>
+	producer make_data_producer(T * in_data);
 	template<typename T>
-	std::function<bool(buffer &)> make_data_producer(const T &in_data);
+	producer make_data_producer(const T &in_data);
 
 	// a utility function to give up a slice of cpu time
 	void yield();
 
+	// a free list of recycled objects with allocation counters
+	template<class T>
+	class pool;
+	struct pool_stats;
+	// shared storage blocks for buffers that only hold memory while in use
+	class buffer_pool;
+
+	// a reference to characters owned by someone else
+	class string_ref;
+	// a counter with one writing thread that any thread can read
+	class counter;
+	// sums the counter blocks of all loops or threads of a kind
+	template<class B,class S>
+	class counter_registry;
+
+	struct pool_stats {
+		size_t live;      // objects currently handed out
+		size_t pooled;    // objects waiting in the free list
+		size_t allocated; // objects created since the pool was made
+		size_t reused;    // times an object was taken from the free list
+	};
+
+	// A free list of equally sized memory blocks. Mirrored blocks (Linux only)
+	// map the same memory twice in a row so that a buffer can be used as a
+	// ring where the data is always contiguous, consumed space is then reused
+	// without compact() moving anything. The size of mirrored blocks is rounded
+	// up to whole pages and each live block uses two memory mappings.
+	class buffer_pool {
+		int m_size;
+		size_t m_limit;
+		bool m_mirror;
+		std::vector<char*> free_list;
+		pool_stats m_stats;
+		buffer_pool(const buffer_pool &)=delete;
+		buffer_pool& operator=(const buffer_pool&)=delete;
+#ifdef __linux__
+		static char* map_mirror(int size) {
+			int fd=memfd_create("net11-buffer",MFD_CLOEXEC);
+			if (fd==-1)
+				return nullptr;
+			char *out=nullptr;
+			if (0==ftruncate(fd,size)) {
+				// reserve room for both views and then map the file over each half
+				void *base=mmap(nullptr,2*(size_t)size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+				if (base!=MAP_FAILED) {
+					if (MAP_FAILED!=mmap(base,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0)
+						&& MAP_FAILED!=mmap((char*)base+size,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0))
+						out=(char*)base;
+					else
+						munmap(base,2*(size_t)size);
+				}
+			}
+			close(fd);
+			return out;
+		}
+#endif
+		char* alloc() {
+#ifdef __linux__
+			if (m_mirror) {
+				char *out=map_mirror(m_size);
+				if (!out)
+					throw std::bad_alloc();
+				return out;
+			}
+#endif
+			return new char[m_size];
+		}
+		void free_block(char *p) {
+#ifdef __linux__
+			if (m_mirror) {
+				munmap(p,2*(size_t)m_size);
+				return;
+			}
+#endif
+			delete[] p;
+		}
+	public:
+		buffer_pool(int in_size,size_t in_limit=1024,bool in_mirror=false):m_size(in_size),m_limit(in_limit),m_mirror(false) {
+			memset(&m_stats,0,sizeof(m_stats));
+#ifdef __linux__
+			if (in_mirror) {
+				long page=sysconf(_SC_PAGESIZE);
+				m_size=(int)((m_size+page-1)/page*page);
+				m_mirror=true;
+			}
+#endif
+		}
+		~buffer_pool() {
+			for (auto p:free_list)
+				free_block(p);
+		}
+		int size() {
+			return m_size;
+		}
+		// true if the blocks are double mapped rings
+		bool mirrored() {
+			return m_mirror;
+		}
+		char* take() {
+			char *out;
+			if (free_list.size()) {
+				out=free_list.back();
+				free_list.pop_back();
+				m_stats.reused++;
+			} else {
+				out=alloc();
+				m_stats.allocated++;
+			}
+			m_stats.live++;
+			return out;
+		}
+		void give(char *p) {
+			m_stats.live--;
+			if (free_list.size()<m_limit)
+				free_list.push_back(p);
+			else
+				free_block(p);
+		}
+		// sets the maximum number of free blocks kept, extra ones are freed
+		void limit(size_t in_limit) {
+			m_limit=in_limit;
+			while (free_list.size()>m_limit) {
+				free_block(free_list.back());
+				free_list.pop_back();
+			}
+		}
+		pool_stats stats() {
+			pool_stats out=m_stats;
+			out.pooled=free_list.size();
+			return out;
+		}
+	};
+
+	namespace scan {
+		// the kernel sets, see NET11_SSE2
+		enum level {
+			portable=0,
+			sse2,
+			avx2
+		};
+
+		inline size_t portable_head_end(const char *p,size_t len) {
+			for (size_t i=0;i+3<len;i++) {
+				const char *cr=(const char*)memchr(p+i,'\r',len-3-i);
+				if (!cr)
+					return 0;
+				i=cr-p;
+				if (p[i+1]=='\n' && p[i+2]=='\r' && p[i+3]=='\n')
+					return i+4;
+			}
+			return 0;
+		}
+		inline size_t portable_find2(const char *p,size_t len,char a,char b) {
+			for (size_t i=0;i<len;i++) {
+				if (p[i]==a || p[i]==b)
+					return i;
+			}
+			return len;
+		}
+		inline void portable_lower(char *dst,const char *src,size_t n) {
+			for (size_t i=0;i<n;i++) {
+				char c=src[i];
+				dst[i]=(c>='A' && c<='Z')?c+('a'-'A'):c;
+			}
+		}
+
+#ifdef NET11_SSE2
+		inline int first_bit(unsigned mask) {
+#ifdef _MSC_VER
+			unsigned long idx;
+			_BitScanForward(&idx,mask);
+			return (int)idx;
+#else
+			return __builtin_ctz(mask);
+#endif
+		}
+		// a CR LF CR LF starts where all four shifted comparisons hold
+		inline size_t sse2_head_end(const char *p,size_t len) {
+			const __m128i cr=_mm_set1_epi8('\r'),lf=_mm_set1_epi8('\n');
+			size_t i=0;
+			for (;i+16+3<=len;i+=16) {
+				__m128i m=_mm_and_si128(
+					_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i)),cr),_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i+1)),lf)),
+					_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i+2)),cr),_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i+3)),lf)));
+				unsigned mask=(unsigned)_mm_movemask_epi8(m);
+				if (mask)
+					return i+first_bit(mask)+4;
+			}
+			size_t rest=portable_head_end(p+i,len-i);
+			return rest?i+rest:0;
+		}
+		inline size_t sse2_find2(const char *p,size_t len,char a,char b) {
+			const __m128i va=_mm_set1_epi8(a),vb=_mm_set1_epi8(b);
+			size_t i=0;
+			for (;i+16<=len;i+=16) {
+				__m128i v=_mm_loadu_si128((const __m128i*)(p+i));
+				unsigned mask=(unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,va),_mm_cmpeq_epi8(v,vb)));
+				if (mask)
+					return i+first_bit(mask);
+			}
+			return i+portable_find2(p+i,len-i,a,b);
+		}
+		// bytes above 127 are negative in the signed compares and stay as they are
+		inline void sse2_lower(char *dst,const char *src,size_t n) {
+			const __m128i before_a=_mm_set1_epi8('A'-1),after_z=_mm_set1_epi8('Z'+1),bit=_mm_set1_epi8(0x20);
+			size_t i=0;
+			for (;i+16<=n;i+=16) {
+				__m128i v=_mm_loadu_si128((const __m128i*)(src+i));
+				__m128i upper=_mm_and_si128(_mm_cmpgt_epi8(v,before_a),_mm_cmplt_epi8(v,after_z));
+				_mm_storeu_si128((__m128i*)(dst+i),_mm_or_si128(v,_mm_and_si128(upper,bit)));
+			}
+			portable_lower(dst+i,src+i,n-i);
+		}
+#endif
+#ifdef NET11_AVX2
+		__attribute__((target("avx2"))) inline size_t avx2_head_end(const char *p,size_t len) {
+			const __m256i cr=_mm256_set1_epi8('\r'),lf=_mm256_set1_epi8('\n');
+			size_t i=0;
+			for (;i+32+3<=len;i+=32) {
+				__m256i m=_mm256_and_si256(
+					_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+i)),cr),_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+i+1)),lf)),
+					_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+i+2)),cr),_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+i+3)),lf)));
+				unsigned mask=(unsigned)_mm256_movemask_epi8(m);
+				if (mask)
+					return i+first_bit(mask)+4;
+			}
+			size_t rest=sse2_head_end(p+i,len-i);
+			return rest?i+rest:0;
+		}
+		__attribute__((target("avx2"))) inline size_t avx2_find2(const char *p,size_t len,char a,char b) {
+			const __m256i va=_mm256_set1_epi8(a),vb=_mm256_set1_epi8(b);
+			size_t i=0;
+			for (;i+32<=len;i+=32) {
+				__m256i v=_mm256_loadu_si256((const __m256i*)(p+i));
+				unsigned mask=(unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v,va),_mm256_cmpeq_epi8(v,vb)));
+				if (mask)
+					return i+first_bit(mask);
+			}
+			return i+sse2_find2(p+i,len-i,a,b);
+		}
+		__attribute__((target("avx2"))) inline void avx2_lower(char *dst,const char *src,size_t n) {
+			const __m256i before_a=_mm256_set1_epi8('A'-1),after_z=_mm256_set1_epi8('Z'+1),bit=_mm256_set1_epi8(0x20);
+			size_t i=0;
+			for (;i+32<=n;i+=32) {
+				__m256i v=_mm256_loadu_si256((const __m256i*)(src+i));
+				__m256i upper=_mm256_and_si256(_mm256_cmpgt_epi8(v,before_a),_mm256_cmpgt_epi8(after_z,v));
+				_mm256_storeu_si256((__m256i*)(dst+i),_mm256_or_si256(v,_mm256_and_si256(upper,bit)));
+			}
+			sse2_lower(dst+i,src+i,n-i);
+		}
+#endif
+
+		struct kernels {
+			level kind;
+			size_t (*head_end)(const char *p,size_t len);
+			size_t (*find2)(const char *p,size_t len,char a,char b);
+			void (*lower)(char *dst,const char *src,size_t n);
+		};
+		// the best set that the build and the cpu support
+		inline kernels best_kernels() {
+#ifdef NET11_AVX2
+			if (__builtin_cpu_supports("avx2"))
+				return kernels{avx2,avx2_head_end,avx2_find2,avx2_lower};
+#endif
+#ifdef NET11_SSE2
+			return kernels{sse2,sse2_head_end,sse2_find2,sse2_lower};
+#else
+			return kernels{portable,portable_head_end,portable_find2,portable_lower};
+#endif
+		}
+		inline kernels& active() {
+			static kernels k=best_kernels();
+			return k;
+		}
+		// the kernel set in use
+		inline level current() {
+			return active().kind;
+		}
+		// switches to a kernel set (for benchmarks and tests), returns false
+		// if the build or the cpu lacks it.
+		inline bool use(level l) {
+			kernels k=best_kernels();
+			if (l>k.kind)
+				return false;
+#ifdef NET11_SSE2
+			if (l==sse2)
+				k=kernels{sse2,sse2_head_end,sse2_find2,sse2_lower};
+#endif
+			if (l==portable)
+				k=kernels{portable,portable_head_end,portable_find2,portable_lower};
+			active()=k;
+			return true;
+		}
+
+		// the length of p up to and including the first CR LF CR LF, 0 if none
+		inline size_t head_end(const char *p,size_t len) {
+			return active().head_end(p,len);
+		}
+		// the offset of the first a or b in p, len if neither is there
+		inline size_t find2(const char *p,size_t len,char a,char b) {
+			return active().find2(p,len,a,b);
+		}
+		// copies n bytes lowering the ASCII letters, dst may be src
+		inline void lower(char *dst,const char *src,size_t n) {
+			active().lower(dst,src,n);
+		}
+	}
+
+	// A pointer and length pair that refers to characters without owning
+	// them, parsers hand these out instead of copies and the memory they
+	// point into decides how long they are valid. str() makes a copy.
+	class string_ref {
+		const char *m_data;
+		size_t m_size;
+	public:
+		static const size_t npos=(size_t)-1;
+		string_ref():m_data(""),m_size(0) {}
+		string_ref(const char *in_data,size_t in_size):m_data(in_data),m_size(in_size) {}
+		string_ref(const char *in_str):m_data(in_str),m_size(strlen(in_str)) {}
+		string_ref(const std::string &in_str):m_data(in_str.data()),m_size(in_str.size()) {}
+		const char* data() const {
+			return m_data;
+		}
+		size_t size() const {
+			return m_size;
+		}
+		bool empty() const {
+			return m_size==0;
+		}
+		const char* begin() const {
+			return m_data;
+		}
+		const char* end() const {
+			return m_data+m_size;
+		}
+		char operator[](size_t idx) const {
+			return m_data[idx];
+		}
+		std::string str() const {
+			return std::string(m_data,m_size);
+		}
+		size_t find(char c,size_t pos=0) const {
+			if (pos>=m_size)
+				return npos;
+			const char *f=(const char*)memchr(m_data+pos,c,m_size-pos);
+			return f?(size_t)(f-m_data):npos;
+		}
+		string_ref substr(size_t pos,size_t count=npos) const {
+			if (pos>m_size)
+				pos=m_size;
+			if (count>m_size-pos)
+				count=m_size-pos;
+			return string_ref(m_data+pos,count);
+		}
+		bool starts_with(string_ref prefix) const {
+			return prefix.m_size<=m_size && 0==memcmp(m_data,prefix.m_data,prefix.m_size);
+		}
+		// compares ignoring ASCII case, as header names are compared
+		bool ieq(string_ref other) const {
+			if (other.m_size!=m_size)
+				return false;
+			for (size_t i=0;i<m_size;i++) {
+				if (std::tolower((unsigned char)m_data[i])!=std::tolower((unsigned char)other.m_data[i]))
+					return false;
+			}
+			return true;
+		}
+	};
+	inline bool operator==(string_ref l,string_ref r) {
+		return l.size()==r.size() && 0==memcmp(l.data(),r.data(),l.size());
+	}
+	inline bool operator!=(string_ref l,string_ref r) {
+		return !(l==r);
+	}
+
 	class buffer {
 		bool m_isview;
+		bool m_mirror; // the data is a double mapped ring, see buffer_pool
 		int m_cap;    // the total number of bytes in this buffer
 		int m_bottom; // the bottom index, ie the first used data element
 		int m_top;    // the top index, the first unused data element
 		char *m_data; // the actual data
+		buffer_pool *m_pool; // the source of the data block for lazily attached buffers
 		buffer(const buffer &)=delete;
 		buffer& operator=(const buffer&)=delete;
+		// keeps the indexes of a mirrored ring within the first mapping, for
+		// flat buffers this only triggers once everything has been consumed.
+		inline void wrap() {
+			if (m_bottom>=m_cap) {
+				m_bottom-=m_cap;
+				m_top-=m_cap;
+			}
+		}
+		void attach() {
+			m_data=m_pool->take();
+			m_mirror=m_pool->mirrored();
+		}
 	public:
 		// Construct a view of a piece of data (nothing available to fill but plenty of used to consume)
-		buffer(char *data,int amount) : m_isview(true),m_cap(amount),m_bottom(0),m_top(amount),m_data(data) {
+		buffer(char *data,int amount) : m_isview(true),m_mirror(false),m_cap(amount),m_bottom(0),m_top(amount),m_data(data),m_pool(nullptr) {
 		}
-		buffer(int capacity) : m_isview(false),m_cap(capacity),m_bottom(0),m_top(0),m_data(new char[capacity]) {
+		buffer(int capacity) : m_isview(false),m_mirror(false),m_cap(capacity),m_bottom(0),m_top(0),m_data(new char[capacity]),m_pool(nullptr) {
 			//m_data=new char[capacity];
 		}
+		// a buffer that takes a block from the pool when data is first produced,
+		// the block can be given back with detach() whenever the buffer is empty.
+		buffer(buffer_pool &pool) : m_isview(false),m_mirror(false),m_cap(pool.size()),m_bottom(0),m_top(0),m_data(nullptr),m_pool(&pool) {
+		}
 		~buffer() {
-			if (!m_isview)
-				delete m_data;
+			if (m_pool) {
+				if (m_data)
+					m_pool->give(m_data);
+			} else if (!m_isview) {
+				delete[] m_data;
+			}
+		}
+		// gives the memory of an empty pooled buffer back, returns false if data is left
+		bool detach() {
+			if (m_top!=m_bottom)
+				return false;
+			m_bottom=0;
+			m_top=0;
+			if (m_pool && m_data) {
+				m_pool->give(m_data);
+				m_data=nullptr;
+			}
+			return true;
+		}
+		// moves an empty pooled buffer over to another pool, returns false if data is left
+		bool rebind(buffer_pool &pool) {
+			if (!detach())
+				return false;
+			m_pool=&pool;
+			m_cap=pool.size();
+			return true;
+		}
+		// true if memory is attached, pooled buffers only hold it while used
+		bool attached() {
+			return m_data!=nullptr;
+		}
+		// empties the buffer so that it can be reused
+		void clear() {
+			m_bottom=0;
+			m_top=0;
 		}
 		// returns the number of bytes corrently in the buffer
 		inline int usage() {
@@ -66,6 +529,9 @@ namespace net11 {
 		}
 		// returns the number of bytes available to produce as a flat array
 		int direct_avail() {
+			// in a mirrored ring the free space always follows the data
+			if (m_mirror)
+				return m_cap-(m_top-m_bottom);
 			return m_cap-m_top;
 		}
 		// returns the total number of bytes available to produce
@@ -74,7 +540,9 @@ namespace net11 {
 		}
 		// compacts the buffer to maximize the flatly available bytes
 		int compact() {
-			if (m_bottom==0)
+			if (!m_data && m_pool)
+				attach();
+			if (m_bottom==0 || m_mirror)
 				return direct_avail();
 			int sz=usage();
 			std::memmove(m_data,m_data+m_bottom,sz);
@@ -91,7 +559,9 @@ namespace net11 {
 		inline char consume() {
 			if (m_bottom>=m_top)
 				throw std::out_of_range("no bytes to consume in buffer");
-			return m_data[m_bottom++];
+			char out=m_data[m_bottom++];
+			wrap();
+			return out;
 		}
 		// returns the pointer to a number of bytes to consume directly.
 		char* to_consume() {
@@ -102,9 +572,12 @@ namespace net11 {
 			if (usage()<amount || amount<0)
 				throw std::invalid_argument("underflow");
 			m_bottom+=amount;
+			wrap();
 		}
 		// adds a byte to the buffer
 		inline void produce(char c) {
+			if (!m_data && m_pool)
+				attach();
 			if (direct_avail()<1) {
 				if (compact()<1) {
 					throw std::out_of_range("no bytes available in buffer");
@@ -138,6 +611,8 @@ namespace net11 {
 		}
 		// returns a the pointer to the free bytes to be written
 		char* to_produce() {
+			if (!m_data && m_pool)
+				attach();
 			return m_data+m_top;
 		}
 		// tell the buffer how many bytes were actually written
@@ -156,28 +631,386 @@ namespace net11 {
 		}
 	};
 
-	template<typename T>
-	std::function<bool(buffer &)> make_data_producer(T * in_data) {
-		std::shared_ptr<int> off(new int);
-		std::shared_ptr<T> data(in_data);
-		*off=0;
-		// return the actual producer function that writes out the contents on request
-		return [data,off](buffer &ob){
-			int dataleft=data->size()-*off; // dl is how much we have left to send
+	// A std::function replacement that stores callables of up to N bytes
+	// inside the object so that typical lambdas (a few pointers, offsets and
+	// a shared_ptr) don't allocate, larger ones are kept on the heap.
+	template<class R,class... A,size_t N>
+	class small_function<R(A...),N> {
+		struct ops {
+			R (*call)(void *f,A&&... args);
+			void (*copy)(void *dst,const void *src);
+			void (*move)(void *dst,void *src); // also destroys src
+			void (*destroy)(void *f);
+		};
+		template<class F>
+		struct local {
+			static R call(void *f,A&&... args) {
+				return (*(F*)f)(std::forward<A>(args)...);
+			}
+			static void copy(void *dst,const void *src) {
+				new (dst) F(*(const F*)src);
+			}
+			static void move(void *dst,void *src) {
+				new (dst) F(std::move(*(F*)src));
+				((F*)src)->~F();
+			}
+			static void destroy(void *f) {
+				((F*)f)->~F();
+			}
+			static const ops* table() {
+				static const ops t={&call,&copy,&move,&destroy};
+				return &t;
+			}
+		};
+		// the storage holds a pointer to the callable
+		template<class F>
+		struct remote {
+			static R call(void *f,A&&... args) {
+				return (**(F**)f)(std::forward<A>(args)...);
+			}
+			static void copy(void *dst,const void *src) {
+				*(F**)dst=new F(**(F* const*)src);
+			}
+			static void move(void *dst,void *src) {
+				*(F**)dst=*(F**)src;
+			}
+			static void destroy(void *f) {
+				delete *(F**)f;
+			}
+			static const ops* table() {
+				static const ops t={&call,&copy,&move,&destroy};
+				return &t;
+			}
+		};
+		template<class F>
+		struct fits {
+			static const bool value=sizeof(F)<=N && alignof(F)<=alignof(std::max_align_t) && std::is_nothrow_move_constructible<F>::value;
+		};
+		typename std::aligned_storage<N<sizeof(void*)?sizeof(void*):N,alignof(std::max_align_t)>::type store;
+		const ops *m_ops;
+		template<class F>
+		void assign(F &&f,std::true_type) {
+			typedef typename std::decay<F>::type T;
+			new (&store) T(std::forward<F>(f));
+			m_ops=local<T>::table();
+		}
+		template<class F>
+		void assign(F &&f,std::false_type) {
+			typedef typename std::decay<F>::type T;
+			*(T**)&store=new T(std::forward<F>(f));
+			m_ops=remote<T>::table();
+		}
+	public:
+		small_function():m_ops(nullptr) {}
+		small_function(std::nullptr_t):m_ops(nullptr) {}
+		template<class F,class=typename std::enable_if<!std::is_same<typename std::decay<F>::type,small_function>::value>::type>
+		small_function(F &&f):m_ops(nullptr) {
+			assign(std::forward<F>(f),std::integral_constant<bool,fits<typename std::decay<F>::type>::value>());
+		}
+		small_function(const small_function &o):m_ops(o.m_ops) {
+			if (m_ops)
+				m_ops->copy(&store,&o.store);
+		}
+		small_function(small_function &&o):m_ops(o.m_ops) {
+			if (m_ops)
+				m_ops->move(&store,&o.store);
+			o.m_ops=nullptr;
+		}
+		~small_function() {
+			if (m_ops)
+				m_ops->destroy(&store);
+		}
+		small_function& operator=(const small_function &o) {
+			if (this!=&o) {
+				small_function tmp(o);
+				*this=std::move(tmp);
+			}
+			return *this;
+		}
+		small_function& operator=(small_function &&o) {
+			if (this!=&o) {
+				if (m_ops)
+					m_ops->destroy(&store);
+				m_ops=o.m_ops;
+				if (m_ops)
+					m_ops->move(&store,&o.store);
+				o.m_ops=nullptr;
+			}
+			return *this;
+		}
+		explicit operator bool() const {
+			return m_ops!=nullptr;
+		}
+		R operator()(A... args) {
+			return m_ops->call(&store,std::forward<A>(args)...);
+		}
+	};
+
+	// A FIFO on a ring of slots that doubles when full, pushing and popping
+	// are O(1) and popped slots are reused without allocating.
+	template<class T>
+	class ring_queue {
+		std::vector<T> slots; // the size is always a power of two
+		size_t head=0;
+		size_t count=0;
+		void grow() {
+			std::vector<T> bigger(slots.size()?slots.size()*2:8);
+			for (size_t i=0;i<count;i++)
+				bigger[i]=std::move((*this)[i]);
+			slots.swap(bigger);
+			head=0;
+		}
+	public:
+		size_t size() const {
+			return count;
+		}
+		bool empty() const {
+			return count==0;
+		}
+		T& front() {
+			return slots[head];
+		}
+		T& back() {
+			return (*this)[count-1];
+		}
+		T& operator[](size_t i) {
+			return slots[(head+i)&(slots.size()-1)];
+		}
+		void push_back(T v) {
+			if (count==slots.size())
+				grow();
+			(*this)[count++]=std::move(v);
+		}
+		// the popped slot is reset so that it doesn't keep resources alive
+		void pop_front() {
+			slots[head]=T();
+			head=(head+1)&(slots.size()-1);
+			count--;
+		}
+		// large rings are given back, small ones kept for reuse
+		void clear() {
+			if (slots.size()>64) {
+				std::vector<T>().swap(slots);
+			} else {
+				while (count)
+					pop_front();
+			}
+			head=0;
+			count=0;
+		}
+	};
+
+	// A producer either runs a function that writes into the output buffer
+	// (returning false when it's finished) or references a block of memory
+	// that stays unchanged until sent, the latter can be passed directly to
+	// the socket by the output path without being copied to the buffer first.
+	// File producers reference a range of an open file in the same way so
+	// that it can be sent with sendfile where supported.
+	class producer {
+		small_function<bool(buffer&)> fn;
+		std::shared_ptr<const void> owner; // keeps referenced data or file alive
+		const char *m_data;
+		int m_fd;
+		uint64_t m_offset;
+		size_t m_left;
+	public:
+		producer():m_data(nullptr),m_fd(-1),m_offset(0),m_left(0) {}
+		template<class F,class=typename std::enable_if<!std::is_same<typename std::decay<F>::type,producer>::value>::type>
+		producer(F in_fn):fn(std::move(in_fn)),m_data(nullptr),m_fd(-1),m_offset(0),m_left(0) {}
+		producer(std::shared_ptr<const void> in_owner,const char *in_data,size_t in_size):owner(in_owner),m_data(in_data),m_fd(-1),m_offset(0),m_left(in_size) {}
+		producer(std::shared_ptr<const void> in_owner,int in_fd,uint64_t in_offset,size_t in_size):owner(in_owner),m_data(nullptr),m_fd(in_fd),m_offset(in_offset),m_left(in_size) {}
+
+		// true if this producer references data instead of running a function
+		bool is_data() {
+			return !fn && m_fd==-1;
+		}
+		// true if this producer references a file range
+		bool is_file() {
+			return m_fd!=-1;
+		}
+		// the data left to send for data producers
+		const char* data() {
+			return m_data;
+		}
+		int file_fd() {
+			return m_fd;
+		}
+		uint64_t file_offset() {
+			return m_offset;
+		}
+		// the number of bytes left for data and file producers
+		size_t size() {
+			return m_left;
+		}
+		void consumed(size_t amount) {
+			if (m_data)
+				m_data+=amount;
+			m_offset+=amount;
+			m_left-=amount;
+		}
+		// copy as much as possible into the buffer, returns false when finished
+		bool operator()(buffer &ob) {
+			if (fn)
+				return fn(ob);
 			int outleft=ob.compact();
-			int to_copy=dataleft<outleft?dataleft:outleft;
-			std::memcpy(ob.to_produce(),data->data()+*off,to_copy);
+			size_t to_copy=m_left<(size_t)outleft?m_left:(size_t)outleft;
+			if (m_fd!=-1) {
+#ifdef _MSC_VER
+				return false;
+#else
+				ssize_t rc=pread(m_fd,ob.to_produce(),to_copy,(off_t)m_offset);
+				if (rc<=0)
+					return false; // always stop sending on error
+				to_copy=rc;
+#endif
+			} else {
+				std::memcpy(ob.to_produce(),m_data,to_copy);
+			}
 			ob.produced(to_copy);
-			*off+=to_copy;
-			return *off!=data->size();
-		};
+			consumed(to_copy);
+			return m_left!=0;
+		}
+	};
+
+	// the container is kept alive by the producer and sent without further copies
+	template<typename T>
+	producer make_data_producer(std::shared_ptr<T> data) {
+		return producer(data,(const char*)data->data(),data->size()*sizeof(*data->data()));
 	}
 
 	template<typename T>
-	std::function<bool(buffer &)> make_data_producer(const T &in_data) {
-		return make_data_producer(new T(in_data));
+	producer make_data_producer(T * in_data) {
+		return make_data_producer(std::shared_ptr<T>(in_data));
 	}
 
+	// the copy shares one allocation with its reference count
+	template<typename T>
+	producer make_data_producer(const T &in_data) {
+		return make_data_producer(std::make_shared<T>(in_data));
+	}
+
+#ifndef _MSC_VER
+	// creates a producer for a range of an open file, the producer takes
+	// ownership of the descriptor and closes it when done.
+	producer make_file_producer(int fd,uint64_t offset,size_t size) {
+		struct fdholder {
+			int fd;
+			fdholder(int in_fd):fd(in_fd) {}
+			~fdholder() {
+				close(fd);
+			}
+		};
+		std::shared_ptr<fdholder> holder(new fdholder(fd));
+#ifdef POSIX_FADV_SEQUENTIAL
+		// we'll read the range front to back so ask for aggressive readahead
+		posix_fadvise(fd,(off_t)offset,(off_t)size,POSIX_FADV_SEQUENTIAL);
+#endif
+		return producer(holder,fd,offset,size);
+	}
+#endif
+
+	// Counters are bumped on hot paths by the thread that owns them, a relaxed
+	// load and store compiles to a plain add without the locked instruction
+	// of fetch_add while other threads can still read a consistent value.
+	class counter {
+		std::atomic<uint64_t> value{0};
+	public:
+		void add(uint64_t n=1) {
+			value.store(value.load(std::memory_order_relaxed)+n,std::memory_order_relaxed);
+		}
+		uint64_t get() const {
+			return value.load(std::memory_order_relaxed);
+		}
+	};
+
+	// Keeps track of counter blocks (B) that each have a single writer and
+	// sums them into a plain struct of totals (S) when read. B provides
+	// sum(S&) and blocks that go away leave their counts behind so the totals
+	// never decrease.
+	template<class B,class S>
+	class counter_registry {
+		std::mutex lock;
+		std::vector<const B*> blocks;
+		S gone;
+	public:
+		counter_registry() {
+			memset(&gone,0,sizeof(gone));
+		}
+		void add(const B *b) {
+			std::lock_guard<std::mutex> guard(lock);
+			blocks.push_back(b);
+		}
+		void remove(const B *b) {
+			std::lock_guard<std::mutex> guard(lock);
+			b->sum(gone);
+			blocks.erase(std::find(blocks.begin(),blocks.end(),b));
+		}
+		S total() {
+			std::lock_guard<std::mutex> guard(lock);
+			S out=gone;
+			for (auto b:blocks)
+				b->sum(out);
+			return out;
+		}
+	};
+
+	// Connections and their state are created and destroyed at a high rate,
+	// a pool keeps up to limit released objects around so that they can be
+	// handed out again instead of going through the allocator. Recycled
+	// objects are reinitialized by calling reuse() with the creation arguments.
+	// A pool is not thread safe, use one per event loop.
+	template<class T>
+	class pool {
+		std::vector<T*> free_list;
+		size_t m_limit;
+		pool_stats m_stats;
+		pool(const pool &)=delete;
+		pool& operator=(const pool&)=delete;
+	public:
+		pool(size_t in_limit=1024):m_limit(in_limit) {
+			memset(&m_stats,0,sizeof(m_stats));
+		}
+		~pool() {
+			for (auto p:free_list)
+				delete p;
+		}
+		template<class... A>
+		T* create(A&&... args) {
+			T *out;
+			if (free_list.size()) {
+				out=free_list.back();
+				free_list.pop_back();
+				out->reuse(std::forward<A>(args)...);
+				m_stats.reused++;
+			} else {
+				out=new T(std::forward<A>(args)...);
+				m_stats.allocated++;
+			}
+			m_stats.live++;
+			return out;
+		}
+		void release(T *p) {
+			m_stats.live--;
+			if (free_list.size()<m_limit)
+				free_list.push_back(p);
+			else
+				delete p;
+		}
+		// sets the maximum number of objects kept, extra ones are freed
+		void limit(size_t in_limit) {
+			m_limit=in_limit;
+			while (free_list.size()>m_limit) {
+				delete free_list.back();
+				free_list.pop_back();
+			}
+		}
+		pool_stats stats() {
+			pool_stats out=m_stats;
+			out.pooled=free_list.size();
+			return out;
+		}
+	};
+
 	class sink {
 	public:
 		// implement this function to make a working sink
@@ -204,24 +1037,34 @@ namespace net11 {
 		{
 			tl=strlen(term);
 		}
+		// forget any partial line
+		void reset() {
+			out.clear();
+		}
+		// bytes of a partial line
+		size_t pending() {
+			return out.size();
+		}
 		virtual bool drain(buffer &buf) {
-			size_t sz=out.size();
 			while(buf.usage()) {
-				if (sz>=szmax) {
+				if (out.size()>=(size_t)szmax) {
 					return false;
 				}
-				//std::cout<<"Pre:["<<out<<"]["<<buf.to_string()<<"]\n";
-				out.push_back(buf.consume());
-				//std::cout<<"Post:["<<out<<"]["<<buf.to_string()<<"]\n";
-				sz++;
-				if (sz>tl) {
-					if (!memcmp(out.data()+sz-tl,term,tl)) {
-						out.resize(sz-tl);
-						//std::cout<<"Line:"<<out<<":\n";
-						bool rv=on_line(out);
-						out.resize(0);
-						return rv;
-					}
+				// take everything up to the last character of the terminator at once
+				const char *p=buf.to_consume();
+				size_t avail=buf.usage();
+				if (avail>szmax-out.size())
+					avail=szmax-out.size();
+				const char *f=(const char*)memchr(p,term[tl-1],avail);
+				size_t take=f?(f-p)+1:avail;
+				out.append(p,take);
+				buf.consumed((int)take);
+				size_t sz=out.size();
+				if (f && sz>(size_t)tl && !memcmp(out.data()+sz-tl,term,tl)) {
+					out.resize(sz-tl);
+					bool rv=on_line(out);
+					out.resize(0);
+					return rv;
 				}
 			}
 			return true;
@@ -244,10 +1087,30 @@ namespace net11 {
 		int count;
 		int maxsz;
 		int (*filter)(int c);
+		bool lower; // keys are lowered in bulk instead of through the filter
 
 		std::function<bool(std::string&,std::string&)> on_header;
 		std::function<bool(const char *err)> on_fin;
+		void append_key(const char *p,size_t n) {
+			size_t at=k.size();
+			k.append(p,n);
+			if (lower) {
+				scan::lower(&k[at],&k[at],n);
+				return;
+			}
+			if (!filter)
+				return;
+			for (size_t i=at;i<k.size();i++)
+				k[i]=filter(k[i]);
+		}
+		static int lower_char(int c) {
+			return (c>='A' && c<='Z')?c+('a'-'A'):c;
+		}
 	public:
+		enum key_case {
+			keep_keys=0,
+			lower_keys
+		};
 		header_parser_sink(
 			int in_maxsz,
 			int (*in_filter)(int c),
@@ -258,9 +1121,32 @@ namespace net11 {
 			count(0),
 			maxsz(in_maxsz),
 			filter(in_filter),
+			lower(false),
+			on_header(in_on_header),
+			on_fin(in_on_fin)
+		{}
+		// keys are passed on as they are or ascii lowercased
+		header_parser_sink(
+			int in_maxsz,
+			key_case in_keys,
+			std::function<bool(std::string&,std::string&)> in_on_header,
+			std::function<bool(const char *err)> in_on_fin
+		):
+			state(firstlinestart),
+			count(0),
+			maxsz(in_maxsz),
+			filter(in_keys==lower_keys?lower_char:nullptr),
+			lower(in_keys==lower_keys),
 			on_header(in_on_header),
 			on_fin(in_on_fin)
 		{}
+		// forget any partial headers and errors
+		void reset() {
+			state=firstlinestart;
+			k.clear();
+			v.clear();
+			count=0;
+		}
 		virtual bool drain(buffer &buf) {
 			// pre-existing error condition, just return.
 			if (count==-1)
@@ -271,6 +1157,24 @@ namespace net11 {
 					count=-1;
 					return false;
 				}
+				// keys and values are taken in bulk up to their delimiters
+				if (state==inkey || state==invalue) {
+					const char *p=buf.to_consume();
+					size_t n=buf.usage();
+					if (n>(size_t)(maxsz-count))
+						n=maxsz-count;
+					const char *f=(const char*)memchr(p,state==inkey?':':13,n);
+					size_t take=f?f-p:n;
+					if (take) {
+						if (state==inkey)
+							append_key(p,take);
+						else
+							v.append(p,take);
+						buf.consumed((int)take);
+						count+=(int)take;
+						continue;
+					}
+				}
 				char c=buf.consume();
 				count++;
 				switch(state) {
@@ -382,46 +1286,342 @@ namespace net11 {
 #else
 		struct timeval tv;
 		gettimeofday(&tv,NULL);
-		return (tv.tv_usec/1000)+(1000*(uint64_t)time(0));
+		return (tv.tv_usec/1000)+(1000*(uint64_t)tv.tv_sec);
 #endif
 	}
 
+	// milliseconds from an unspecified start that never jumps with clock changes
+	uint64_t monotonic_millis() {
+#ifdef _MSC_VER
+		return GetTickCount64();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+#endif
+	}
+
+	// A hierarchical timer wheel of intrusive nodes with millisecond ticks.
+	// Each level has 64 slots covering 64 times the span of the level below,
+	// nodes are placed on the lowest level where the deadline shares the upper
+	// bits with the current tick and cascade down as those slots come due.
+	// Scheduling and cancelling are O(1) and advancing skips empty slots by
+	// looking at a per level bitmap.
+	class timer_wheel {
+	public:
+		struct node {
+			node *prev=nullptr;
+			node *next=nullptr;
+			uint64_t deadline=0;
+			void *data=nullptr; // the owner of the node
+			int slot=0;
+			bool scheduled() {
+				return prev!=nullptr;
+			}
+		};
+	private:
+		static const int bits=6;
+		static const int slot_count=1<<bits;
+		static const int levels=8; // 48 bits of milliseconds, further deadlines are clamped
+		node heads[levels*slot_count];
+		uint64_t used[levels]; // bitmaps of non empty slots
+		uint64_t current; // the last tick that has been processed
+		size_t count;
+		timer_wheel(const timer_wheel &)=delete;
+		timer_wheel& operator=(const timer_wheel&)=delete;
+		static void link(node &head,node &n) {
+			n.prev=&head;
+			n.next=head.next;
+			head.next->prev=&n;
+			head.next=&n;
+		}
+		static void unlink(node &n) {
+			n.prev->next=n.next;
+			n.next->prev=n.prev;
+			n.prev=nullptr;
+			n.next=nullptr;
+		}
+		static int high_bit(uint64_t v) {
+#ifdef __GNUC__
+			return 63-__builtin_clzll(v);
+#else
+			int r=0;
+			while (v>>=1)
+				r++;
+			return r;
+#endif
+		}
+		static int low_bit(uint64_t v) {
+#ifdef __GNUC__
+			return __builtin_ctzll(v);
+#else
+			int r=0;
+			while (!(v&1)) {
+				v>>=1;
+				r++;
+			}
+			return r;
+#endif
+		}
+		void place(node &n,uint64_t at) {
+			// deadlines past the span of the top level wait at its end and are placed again
+			uint64_t limit=current|((1ULL<<(bits*levels))-1);
+			if (at>limit)
+				at=limit>current?limit:current+1;
+			uint64_t diff=at^current;
+			int level=diff<(uint64_t)slot_count?0:high_bit(diff)/bits;
+			if (level>=levels)
+				level=levels-1;
+			int idx=(int)(at>>(level*bits))&(slot_count-1);
+			n.slot=level*slot_count+idx;
+			link(heads[n.slot],n);
+			used[level]|=1ULL<<idx;
+		}
+		void remove(node &n) {
+			unlink(n);
+			node &head=heads[n.slot];
+			if (head.next==&head)
+				used[n.slot/slot_count]&=~(1ULL<<(n.slot%slot_count));
+		}
+		// moves a slot to a local list so that callers can reschedule freely
+		void take(int slot,node &pending) {
+			node &head=heads[slot];
+			pending.prev=pending.next=&pending;
+			while (head.next!=&head) {
+				node *n=head.next;
+				unlink(*n);
+				link(pending,*n);
+			}
+			used[slot/slot_count]&=~(1ULL<<(slot%slot_count));
+		}
+		// the first tick where a non empty slot comes due, slots are always
+		// ahead of the current position on their level except for overdue
+		// nodes in the current slot of the lowest level
+		uint64_t next_tick() {
+			if (used[0]&(1ULL<<(current&(slot_count-1))))
+				return current;
+			uint64_t best=~(uint64_t)0;
+			for (int l=0;l<levels;l++) {
+				int pos=(int)(current>>(l*bits))&(slot_count-1);
+				uint64_t ahead=pos==slot_count-1?0:used[l]&(~(uint64_t)0<<(pos+1));
+				int shift=(l+1)*bits;
+				uint64_t base=shift<64?(current>>shift)<<shift:0;
+				// the top level slots behind the position hold the clamped nodes of the next span
+				if (!ahead && l==levels-1 && used[l]) {
+					ahead=used[l];
+					base+=1ULL<<shift;
+				}
+				if (!ahead)
+					continue;
+				uint64_t at=base|((uint64_t)low_bit(ahead)<<(l*bits));
+				if (at<best)
+					best=at;
+			}
+			return best;
+		}
+	public:
+		timer_wheel(uint64_t now):current(now),count(0) {
+			for (auto &h:heads)
+				h.prev=h.next=&h;
+			for (auto &u:used)
+				u=0;
+		}
+		size_t size() {
+			return count;
+		}
+		// (re)schedules a node to fire at the deadline in milliseconds,
+		// deadlines already passed fire on the next advance
+		void schedule(node &n,uint64_t deadline) {
+			if (n.scheduled())
+				cancel(n);
+			n.deadline=deadline;
+			place(n,deadline>current?deadline:current);
+			count++;
+		}
+		void cancel(node &n) {
+			if (!n.scheduled())
+				return;
+			remove(n);
+			count--;
+		}
+		// calls fn(node&) for every node whose deadline has been reached, the
+		// node is unscheduled first so fn may schedule it again.
+		template<class F>
+		void advance(uint64_t now,F fn) {
+			while (count) {
+				uint64_t at=next_tick();
+				if (at>now)
+					break;
+				current=at;
+				node pending;
+				// higher levels cascade into the lower ones first
+				for (int l=levels-1;l>0;l--) {
+					if (current&((1ULL<<(l*bits))-1))
+						continue;
+					int idx=(int)(current>>(l*bits))&(slot_count-1);
+					if (!(used[l]&(1ULL<<idx)))
+						continue;
+					take(l*slot_count+idx,pending);
+					while (pending.next!=&pending) {
+						node *n=pending.next;
+						unlink(*n);
+						place(*n,n->deadline>current?n->deadline:current);
+					}
+				}
+				int idx=(int)current&(slot_count-1);
+				if (!(used[0]&(1ULL<<idx)))
+					continue;
+				take(idx,pending);
+				while (pending.next!=&pending) {
+					node *n=pending.next;
+					unlink(*n);
+					// clamped nodes reach the lowest level before their deadline
+					if (n->deadline>current) {
+						place(*n,n->deadline);
+						continue;
+					}
+					count--;
+					fn(*n);
+				}
+			}
+			if (now>current)
+				current=now;
+		}
+		// milliseconds until the next slot is due, -1 when empty
+		int next_timeout(uint64_t now) {
+			if (!count)
+				return -1;
+			uint64_t at=next_tick();
+			if (at<=now)
+				return 0;
+			return at-now>0x7fffffff?0x7fffffff:(int)(at-now);
+		}
+	};
+
+	// Runs functions after a delay or periodically, times are relative to the
+	// monotonic clock that is cached once per poll (or per loop turn when
+	// driven by tcp::poll).
 	class scheduler {
 		struct event {
-			//uint64_t next;
-			uint64_t period; // for recurring events
+			timer_wheel::node timer;
+			uint32_t gen=0;
+			bool firing=false;
+			bool cancelled=false;
+			uint64_t period=0; // for recurring events
 			std::function<void()> once;
 			std::function<bool()> recurring;
-			event(std::function<void()> f):period(0),once(f) {}
-			event(uint64_t in_period,std::function<bool()> f):period(in_period),recurring(f) {}
 		};
-		std::multimap<uint64_t,event> events;
 	public:
-		void timeout(uint64_t timeout,std::function<void()> f) {
-			uint64_t event_time=current_time_millis()+timeout;
-			events.emplace(event_time,event(f));
+		// identifies a scheduled event, stays safe to cancel after it is gone
+		class handle {
+			friend class scheduler;
+			event *e=nullptr;
+			uint32_t gen=0;
+		public:
+			explicit operator bool() const {
+				return e!=nullptr;
+			}
+		};
+	private:
+		uint64_t now_ms;
+		timer_wheel wheel;
+		std::vector<std::unique_ptr<event>> events;
+		std::vector<event*> free_events;
+		scheduler(const scheduler &)=delete;
+		scheduler& operator=(const scheduler&)=delete;
+		event* alloc() {
+			if (free_events.empty()) {
+				events.emplace_back(new event());
+				events.back()->timer.data=events.back().get();
+				return events.back().get();
+			}
+			event *e=free_events.back();
+			free_events.pop_back();
+			return e;
+		}
+		void release(event *e) {
+			e->gen++;
+			e->firing=false;
+			e->cancelled=false;
+			e->period=0;
+			e->once=nullptr;
+			e->recurring=nullptr;
+			free_events.push_back(e);
+		}
+		// the deadline delay after at, saturated so that huge delays stay pending
+		static uint64_t later(uint64_t at,uint64_t delay) {
+			return delay>~0ULL-at?~0ULL:at+delay;
+		}
+		handle start(event *e,uint64_t timeout) {
+			wheel.schedule(e->timer,later(now_ms,timeout));
+			handle h;
+			h.e=e;
+			h.gen=e->gen;
+			return h;
+		}
+	public:
+		scheduler():now_ms(monotonic_millis()),wheel(now_ms) {}
+		handle timeout(uint64_t timeout,std::function<void()> f) {
+			event *e=alloc();
+			e->once=std::move(f);
+			return start(e,timeout);
 		}
-		void interval(uint64_t timeout,uint64_t period,std::function<bool()> f) {
-			uint64_t event_time=current_time_millis()+timeout;
-			events.emplace(event_time,event(period,f));
+		// f is called every period until it returns false
+		handle interval(uint64_t timeout,uint64_t period,std::function<bool()> f) {
+			event *e=alloc();
+			e->period=period?period:1;
+			e->recurring=std::move(f);
+			return start(e,timeout);
 		}
-		void poll() {
-			uint64_t now=current_time_millis();
-			while(!events.empty()) {
-				auto bi=events.begin();
-				if (bi->first>now)
-					break;
-				if (bi->second.period) {
-					if (bi->second.recurring()) {
-						uint64_t next=bi->first+bi->second.period;
-						events.emplace(next,event(bi->second.period,bi->second.recurring));
-						bi=events.begin();
+		// returns false if the event has already run or been cancelled
+		bool cancel(handle h) {
+			event *e=h.e;
+			if (!e || e->gen!=h.gen)
+				return false;
+			if (e->firing) {
+				if (e->cancelled || !e->period)
+					return false;
+				e->cancelled=true;
+				return true;
+			}
+			wheel.cancel(e->timer);
+			release(e);
+			return true;
+		}
+		size_t size() {
+			return wheel.size();
+		}
+		// the cached clock, tcp::poll refreshes it after waiting for io
+		uint64_t now() {
+			return now_ms;
+		}
+		void set_now(uint64_t now) {
+			now_ms=now;
+		}
+		// milliseconds until the next event is due, -1 when nothing is scheduled
+		int next_timeout() {
+			return wheel.next_timeout(monotonic_millis());
+		}
+		// runs the events that are due at now (the loop's cached clock)
+		void poll(uint64_t now) {
+			now_ms=now;
+			wheel.advance(now_ms,[this](timer_wheel::node &n) {
+				event *e=(event*)n.data;
+				e->firing=true;
+				if (e->period) {
+					if (e->recurring() && !e->cancelled) {
+						e->firing=false;
+						wheel.schedule(e->timer,later(e->timer.deadline,e->period));
+						return;
 					}
 				} else {
-					bi->second.once();
+					e->once();
 				}
-				events.erase(bi);
-			}
+				release(e);
+			});
+		}
+		void poll() {
+			poll(monotonic_millis());
 		}
 	};
 